@@ -0,0 +1,171 @@
+#ifndef SQL_ARRAY_H
+#define SQL_ARRAY_H
+
+#include "SQL_Column.h"
+#include "SQL_Value.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+
+namespace SQL {
+
+// Name of the table valued function and the pointer type bound to it
+#define ARRAY_MODULE_NAME "wrapper_array"
+
+// A borrowed array of values bound as a single parameter, read in SQL as
+//   ... WHERE id IN wrapper_array(?)
+// carray style: nothing is copied, the array has to outlive the statement.
+struct ArrayParam_t {
+  enum Kind { Integers = 0, Strings = 1, Values = 2 };
+
+  Kind kind;
+  size_t count;
+  const int64_t *ints = nullptr;
+  const std::string *strings = nullptr;
+  const SqlValue *values = nullptr;
+
+  ArrayParam_t(std::span<const int64_t> keys)
+      : kind(Integers), count(keys.size()), ints(keys.data()) {}
+  ArrayParam_t(std::span<const std::string> keys)
+      : kind(Strings), count(keys.size()), strings(keys.data()) {}
+  ArrayParam_t(const Column_t &keys)
+      : kind(Values), count(keys.rowCount), values(keys.values) {}
+
+  void result(sqlite3_context *ctx, size_t i) const {
+    switch (kind) {
+    case Integers:
+      sqlite3_result_int64(ctx, ints[i]);
+      break;
+    case Strings:
+      sqlite3_result_text(ctx, strings[i].data(), strings[i].size(),
+                          SQLITE_STATIC);
+      break;
+    case Values:
+      values[i].result(ctx, SQLITE_STATIC);
+      break;
+    }
+  }
+
+  int bind(sqlite3_stmt *stmt, int idx) const {
+    return sqlite3_bind_pointer(stmt, idx, (void *)this, ARRAY_MODULE_NAME,
+                                nullptr);
+  }
+};
+
+// Eponymous virtual table behind wrapper_array(?), one row per element
+struct ArrayVTab_t {
+  enum Columns { Value = 0, Pointer = 1 };
+
+  struct Cursor_t {
+    sqlite3_vtab_cursor base;
+    const ArrayParam_t *array = nullptr;
+    size_t pos = 0;
+  };
+
+  static int connect(sqlite3 *db, void *, int, const char *const *,
+                     sqlite3_vtab **vtab, char **) {
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(value, ptr HIDDEN);");
+    if (rc != SQLITE_OK)
+      return rc;
+    *vtab = (sqlite3_vtab *)sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (*vtab == nullptr)
+      return SQLITE_NOMEM;
+    memset(*vtab, 0, sizeof(sqlite3_vtab));
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    return SQLITE_OK;
+  }
+
+  static int disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+  }
+
+  // Only usable with the array argument bound
+  static int bestIndex(sqlite3_vtab *, sqlite3_index_info *info) {
+    for (int i = 0; i < info->nConstraint; ++i) {
+      const auto &c = info->aConstraint[i];
+      if (c.iColumn != Pointer || c.op != SQLITE_INDEX_CONSTRAINT_EQ)
+        continue;
+      if (!c.usable)
+        return SQLITE_CONSTRAINT;
+
+      info->aConstraintUsage[i].argvIndex = 1;
+      info->aConstraintUsage[i].omit = 1;
+      info->estimatedCost = 1000;
+      info->estimatedRows = 100;
+      info->idxNum = 1;
+      return SQLITE_OK;
+    }
+    info->estimatedCost = 1e99;
+    return SQLITE_OK;
+  }
+
+  static int open(sqlite3_vtab *, sqlite3_vtab_cursor **cursor) {
+    *cursor = &(new Cursor_t())->base;
+    return SQLITE_OK;
+  }
+
+  static int close(sqlite3_vtab_cursor *cursor) {
+    delete (Cursor_t *)cursor;
+    return SQLITE_OK;
+  }
+
+  static int filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *,
+                    int argc, sqlite3_value **argv) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    cur->pos = 0;
+    cur->array = (idxNum == 1 && argc == 1)
+                     ? (const ArrayParam_t *)sqlite3_value_pointer(
+                           argv[0], ARRAY_MODULE_NAME)
+                     : nullptr;
+    return SQLITE_OK;
+  }
+
+  static int next(sqlite3_vtab_cursor *cursor) {
+    ((Cursor_t *)cursor)->pos++;
+    return SQLITE_OK;
+  }
+
+  static int eof(sqlite3_vtab_cursor *cursor) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    return cur->array == nullptr || cur->pos >= cur->array->count;
+  }
+
+  static int column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+                    int col) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    if (col == Value)
+      cur->array->result(ctx, cur->pos);
+    return SQLITE_OK;
+  }
+
+  static int rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = (sqlite3_int64)((Cursor_t *)cursor)->pos;
+    return SQLITE_OK;
+  }
+
+  static const sqlite3_module *module() {
+    static sqlite3_module m = [] {
+      sqlite3_module m = {};
+      m.iVersion = 1;
+      m.xConnect = connect; // no xCreate, eponymous only
+      m.xBestIndex = bestIndex;
+      m.xDisconnect = disconnect;
+      m.xOpen = open;
+      m.xClose = close;
+      m.xFilter = filter;
+      m.xNext = next;
+      m.xEof = eof;
+      m.xColumn = column;
+      m.xRowid = rowid;
+      return m;
+    }();
+    return &m;
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef SQL_BUSY_H
+#define SQL_BUSY_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <sqlite3.h>
+#include <thread>
+
+namespace SQL {
+
+// How long and how eagerly to wait for locks held by other connections.
+// Waits grow exponentially from baseDelayUs up to maxDelayUs with +-50%
+// jitter so contending processes spread out instead of retrying in step.
+struct BusyPolicy_t {
+  unsigned int baseDelayUs = 100;
+  unsigned int maxDelayUs = 5000;
+  // Lock wait of a single statement, and the deadline of a whole
+  // SQL_DB::transaction() with all of its retries
+  unsigned int timeoutMs = 5000;
+  // Lock wait inside transaction(), which then rolls back and retries the
+  // body after a backoff until timeoutMs passes
+  unsigned int lockTimeoutMs = 200;
+};
+
+struct BusyStats_t {
+  uint64_t waits = 0;    // busy handler sleeps
+  uint64_t waitedUs = 0; // total time slept in the busy handler
+  uint64_t timeouts = 0; // lock attempts given up on
+  uint64_t retries = 0;  // whole transactions run again after SQLITE_BUSY
+};
+
+class BusyScheduler_t {
+public:
+  BusyPolicy_t policy;
+
+  void install(sqlite3 *db) { sqlite3_busy_handler(db, handler, this); }
+
+  // Jittered delay before wait number attempt (0 based)
+  unsigned int backoffUs(int attempt) {
+    unsigned int delay = policy.maxDelayUs;
+    if (attempt < 30)
+      delay = std::min<unsigned long>(policy.maxDelayUs,
+                                      (unsigned long)policy.baseDelayUs
+                                          << attempt);
+
+    thread_local std::minstd_rand rng(std::random_device{}());
+    std::uniform_int_distribution<unsigned int> jitter(delay / 2,
+                                                       delay + delay / 2);
+    return jitter(rng);
+  }
+
+  void sleep(unsigned int us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+    waits++;
+    waitedUs += us;
+  }
+
+  void countRetry() { retries++; }
+
+  // Set by transaction() while it runs, lock waits then end after
+  // lockTimeoutMs or at deadline, whichever comes first
+  void retryUntil(std::chrono::steady_clock::time_point deadline) {
+    retryDeadline = deadline;
+    retrying = true;
+  }
+  void stopRetrying() { retrying = false; }
+
+  BusyStats_t stats() const {
+    BusyStats_t s;
+    s.waits = waits;
+    s.waitedUs = waitedUs;
+    s.timeouts = timeouts;
+    s.retries = retries;
+    return s;
+  }
+
+private:
+  std::atomic<uint64_t> waits{0};
+  std::atomic<uint64_t> waitedUs{0};
+  std::atomic<uint64_t> timeouts{0};
+  std::atomic<uint64_t> retries{0};
+  std::chrono::steady_clock::time_point waitStart;
+  std::chrono::steady_clock::time_point retryDeadline;
+  bool retrying = false;
+
+  // SQLite calls this while a lock is held elsewhere, count restarts at 0
+  // for every new lock attempt. Returning 0 surfaces SQLITE_BUSY.
+  static int handler(void *data, int count) {
+    BusyScheduler_t *busy = (BusyScheduler_t *)data;
+    auto now = std::chrono::steady_clock::now();
+    if (count == 0)
+      busy->waitStart = now;
+
+    const BusyPolicy_t &p = busy->policy;
+    auto limit = std::chrono::milliseconds(busy->retrying ? p.lockTimeoutMs
+                                                          : p.timeoutMs);
+    if (now - busy->waitStart >= limit ||
+        (busy->retrying && now >= busy->retryDeadline)) {
+      busy->timeouts++;
+      return 0;
+    }
+
+    busy->sleep(busy->backoffUs(count));
+    return 1;
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef SQL_CDC_H
+#define SQL_CDC_H
+
+#include "SQL_Plan.h"
+#include "SQL_Row.h"
+#include "SQL_Value.h"
+#include <atomic>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <sqlite3.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace SQL {
+
+// Bounded queue without locks, safe for any number of producers and
+// consumers (one slot sequence number per entry). Pushing into a full ring
+// fails instead of waiting, so producers never block on slow consumers.
+template <typename T> class RingBuffer_t {
+public:
+  // capacity is rounded up to a power of two
+  explicit RingBuffer_t(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    mask = size - 1;
+    slots.reset(new Slot_t[size]);
+    for (size_t i = 0; i < size; ++i)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  bool tryPush(T &&item) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot_t &slot = slots[pos & mask];
+      size_t seq = slot.seq.load(std::memory_order_acquire);
+      long diff = (long)seq - (long)pos;
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          slot.item = std::move(item);
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T &item) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot_t &slot = slots[pos & mask];
+      size_t seq = slot.seq.load(std::memory_order_acquire);
+      long diff = (long)seq - (long)(pos + 1);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          item = std::move(slot.item);
+          slot.seq.store(pos + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  // Items refused because the ring was full
+  uint64_t dropped() const { return rejected.load(std::memory_order_relaxed); }
+
+private:
+  struct Slot_t {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  std::unique_ptr<Slot_t[]> slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0}; // next slot to push
+  alignas(64) std::atomic<size_t> tail{0}; // next slot to pop
+  alignas(64) std::atomic<uint64_t> rejected{0};
+};
+
+// One committed row change. Images hold the values in table column order
+// as stored, compressed columns stay framed. They are only filled when
+// built with SQLITE_ENABLE_PREUPDATE_HOOK, otherwise just the operation,
+// table and rowid are known.
+struct ChangeEvent_t {
+  enum Op {
+    Insert = SQLITE_INSERT,
+    Delete = SQLITE_DELETE,
+    Update = SQLITE_UPDATE
+  };
+
+  Op op = Insert;
+  std::string table;
+  int64_t rowid = 0;    // rowid after the change, the removed one for Delete
+  int64_t oldRowid = 0; // differs from rowid when an update changed it
+  Row_t before;         // Update and Delete
+  Row_t after;          // Insert and Update
+};
+
+typedef RingBuffer_t<ChangeEvent_t> ChangeStream_t;
+
+// Collects the changes of the open transaction from the row hooks and
+// publishes them once its COMMIT has succeeded, a rollback discards them
+// and so does ROLLBACK TO for the changes made after the savepoint. A
+// COMMIT that fails (SQLITE_BUSY) publishes nothing, transaction() rolls
+// back and the retry collects the changes again. Takes the connection's
+// trace callback to see statements finish.
+class ChangeCapture_t {
+public:
+  void install(sqlite3 *db, std::shared_ptr<ChangeStream_t> stream) {
+    this->stream = std::move(stream);
+    reset();
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+    sqlite3_preupdate_hook(db, preupdate, this);
+#else
+    sqlite3_update_hook(db, update, this);
+#endif
+    sqlite3_commit_hook(db, commit, this);
+    sqlite3_rollback_hook(db, rollback, this);
+    sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, trace,
+                     this);
+  }
+
+  void uninstall(sqlite3 *db) {
+    if (!stream)
+      return;
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+    sqlite3_preupdate_hook(db, nullptr, nullptr);
+#else
+    sqlite3_update_hook(db, nullptr, nullptr);
+#endif
+    sqlite3_commit_hook(db, nullptr, nullptr);
+    sqlite3_rollback_hook(db, nullptr, nullptr);
+    sqlite3_trace_v2(db, 0, nullptr, nullptr);
+    stream.reset();
+    reset();
+  }
+
+private:
+  // A savepoint and how many changes were pending when it was set
+  struct Mark_t {
+    std::string name;
+    size_t pending;
+  };
+
+  std::shared_ptr<ChangeStream_t> stream;
+  std::vector<ChangeEvent_t> pending;
+  std::vector<Mark_t> marks;
+  bool committing = false; // the commit hook ran for the pending changes
+
+  void reset() {
+    pending.clear();
+    marks.clear();
+    committing = false;
+  }
+
+  // The temp schema holds registered matrices and scratch tables
+  static bool captured(const char *dbName) {
+    return sqlite3_stricmp(dbName, "temp") != 0;
+  }
+
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+  static void preupdate(void *data, sqlite3 *db, int op, const char *dbName,
+                        const char *table, sqlite3_int64 oldKey,
+                        sqlite3_int64 newKey) {
+    if (!captured(dbName))
+      return;
+
+    ChangeEvent_t e;
+    e.op = (ChangeEvent_t::Op)op;
+    e.table = table;
+    e.rowid = (op == SQLITE_DELETE) ? oldKey : newKey;
+    e.oldRowid = oldKey;
+
+    int colCount = sqlite3_preupdate_count(db);
+    sqlite3_value *value;
+    if (op != SQLITE_INSERT) {
+      e.before = Row_t(colCount);
+      SqlValue *before = e.before.editValues();
+      for (int c = 0; c < colCount; ++c)
+        if (sqlite3_preupdate_old(db, c, &value) == SQLITE_OK)
+          before[c] = SqlValue::from_value(value);
+    }
+    if (op != SQLITE_DELETE) {
+      e.after = Row_t(colCount);
+      SqlValue *after = e.after.editValues();
+      for (int c = 0; c < colCount; ++c)
+        if (sqlite3_preupdate_new(db, c, &value) == SQLITE_OK)
+          after[c] = SqlValue::from_value(value);
+    }
+    ((ChangeCapture_t *)data)->pending.push_back(std::move(e));
+  }
+#else
+  static void update(void *data, int op, const char *dbName,
+                     const char *table, sqlite3_int64 rowid) {
+    if (!captured(dbName))
+      return;
+
+    ChangeEvent_t e;
+    e.op = (ChangeEvent_t::Op)op;
+    e.table = table;
+    e.rowid = e.oldRowid = rowid;
+    ((ChangeCapture_t *)data)->pending.push_back(std::move(e));
+  }
+#endif
+
+  // Runs before the commit is written, publishing waits for the statement
+  // to finish with the connection back in autocommit
+  static int commit(void *data) {
+    ((ChangeCapture_t *)data)->committing = true;
+    return 0;
+  }
+
+  static void rollback(void *data) { ((ChangeCapture_t *)data)->reset(); }
+
+  static int trace(unsigned type, void *data, void *p, void *x) {
+    ChangeCapture_t *capture = (ChangeCapture_t *)data;
+    if (type == SQLITE_TRACE_STMT)
+      capture->savepoint((const char *)x);
+    else if (type == SQLITE_TRACE_PROFILE)
+      capture->finished(sqlite3_db_handle((sqlite3_stmt *)p));
+    return 0;
+  }
+
+  // A full ring drops events (counted in dropped()) instead of holding up
+  // the writer
+  void finished(sqlite3 *db) {
+    if (!committing)
+      return;
+    if (sqlite3_get_autocommit(db) == 0) {
+      // The COMMIT failed and the transaction is still open
+      committing = false;
+      return;
+    }
+    for (ChangeEvent_t &e : pending)
+      stream->tryPush(std::move(e));
+    reset();
+  }
+
+  // SAVEPOINT name, RELEASE [SAVEPOINT] name and
+  // ROLLBACK [TRANSACTION] TO [SAVEPOINT] name, trigger bodies come in as
+  // comments and are skipped
+  void savepoint(const char *sql) {
+    while (isspace((unsigned char)*sql))
+      ++sql;
+    if (sqlite3_strnicmp(sql, "SAVEPOINT", 9) != 0 &&
+        sqlite3_strnicmp(sql, "RELEASE", 7) != 0 &&
+        sqlite3_strnicmp(sql, "ROLLBACK", 8) != 0)
+      return;
+
+    std::vector<std::string> t = tokenizeSQL(sql);
+    size_t i = 1;
+    auto skip = [&](const char *word) {
+      if (i < t.size() && sqlite3_stricmp(t[i].c_str(), word) == 0)
+        ++i;
+    };
+    if (sqlite3_stricmp(t[0].c_str(), "SAVEPOINT") == 0) {
+      if (i < t.size())
+        marks.push_back({t[i], pending.size()});
+      return;
+    }
+    bool rollbackTo = sqlite3_stricmp(t[0].c_str(), "ROLLBACK") == 0;
+    if (rollbackTo) {
+      skip("TRANSACTION");
+      if (i >= t.size() || sqlite3_stricmp(t[i].c_str(), "TO") != 0)
+        return; // a plain ROLLBACK, the rollback hook sees it
+      ++i;
+    } else if (sqlite3_stricmp(t[0].c_str(), "RELEASE") != 0) {
+      return;
+    }
+    skip("SAVEPOINT");
+    if (i >= t.size())
+      return;
+
+    for (size_t m = marks.size(); m-- > 0;) {
+      if (sqlite3_stricmp(marks[m].name.c_str(), t[i].c_str()) != 0)
+        continue;
+      // ROLLBACK TO keeps the savepoint itself, RELEASE removes it
+      if (rollbackTo)
+        pending.resize(marks[m].pending);
+      marks.resize(rollbackTo ? m + 1 : m);
+      return;
+    }
+  }
+};
+
+} // namespace SQL
+
+#endif
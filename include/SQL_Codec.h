@@ -0,0 +1,156 @@
+#ifndef SQL_CODEC_H
+#define SQL_CODEC_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+namespace SQL {
+
+// Compressed values are stored as a Blob framed by 2 magic bytes, the frame
+// version, a 1 byte SqlValue type and the 8 byte little-endian raw size,
+// followed by the codec output
+#define CODEC_HEADER_SIZE (12)
+#define CODEC_MAGIC_0 (0xC5)
+#define CODEC_MAGIC_1 (0x51)
+#define CODEC_VERSION (1)
+
+// Pluggable compression for Text/Blob columns. Implementations must be
+// thread safe, a single codec is shared by every value of a column.
+class Codec_t {
+public:
+  virtual ~Codec_t() = default;
+
+  // Appends the compressed form of data to out, false on failure
+  virtual bool compress(const uint8_t *data, size_t n,
+                        std::vector<uint8_t> &out) const = 0;
+
+  // Fills out with exactly rawSize decompressed bytes, false on failure
+  virtual bool decompress(const uint8_t *data, size_t n, uint8_t *out,
+                          size_t rawSize) const = 0;
+
+  // Largest raw size per compressed byte the codec can produce. Frames
+  // claiming more are not decoded, so a Blob that only looks like a frame
+  // cannot make the reader allocate an arbitrary size. 1032 is deflate's.
+  virtual size_t maxExpansion() const { return 1032; }
+};
+
+inline void writeCodecHeader(std::vector<uint8_t> &frame, uint8_t type,
+                             uint64_t rawSize) {
+  frame.assign(CODEC_HEADER_SIZE, 0);
+  frame[0] = CODEC_MAGIC_0;
+  frame[1] = CODEC_MAGIC_1;
+  frame[2] = CODEC_VERSION;
+  frame[3] = type;
+  for (int i = 0; i < 8; ++i)
+    frame[4 + i] = (uint8_t)(rawSize >> (8 * i));
+}
+
+// Reads the header of a frame of n bytes, false when it is not a frame of
+// this version or claims more than codec can expand to
+inline bool readCodecHeader(const uint8_t *p, size_t n, const Codec_t &codec,
+                            uint8_t &type, uint64_t &rawSize) {
+  if (n < CODEC_HEADER_SIZE || p[0] != CODEC_MAGIC_0 ||
+      p[1] != CODEC_MAGIC_1 || p[2] != CODEC_VERSION)
+    return false;
+  type = p[3];
+  rawSize = 0;
+  for (int i = 0; i < 8; ++i)
+    rawSize |= (uint64_t)p[4 + i] << (8 * i);
+  return rawSize / codec.maxExpansion() <= n - CODEC_HEADER_SIZE;
+}
+
+class ZlibCodec_t : public Codec_t {
+public:
+  ZlibCodec_t(int level = Z_DEFAULT_COMPRESSION, std::string dictionary = "")
+      : level(level), dictionary(std::move(dictionary)) {}
+
+  bool compress(const uint8_t *data, size_t n,
+                std::vector<uint8_t> &out) const override {
+    z_stream zs = {};
+    if (deflateInit(&zs, level) != Z_OK)
+      return false;
+    if (!dictionary.empty() &&
+        deflateSetDictionary(&zs, (const Bytef *)dictionary.data(),
+                             dictionary.size()) != Z_OK) {
+      deflateEnd(&zs);
+      return false;
+    }
+
+    size_t start = out.size();
+    out.resize(start + deflateBound(&zs, n));
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = n;
+    zs.next_out = out.data() + start;
+    zs.avail_out = out.size() - start;
+
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(start + zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+  }
+
+  bool decompress(const uint8_t *data, size_t n, uint8_t *out,
+                  size_t rawSize) const override {
+    z_stream zs = {};
+    if (inflateInit(&zs) != Z_OK)
+      return false;
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = n;
+    zs.next_out = out;
+    zs.avail_out = rawSize;
+
+    int rc = inflate(&zs, Z_FINISH);
+    if (rc == Z_NEED_DICT && !dictionary.empty() &&
+        inflateSetDictionary(&zs, (const Bytef *)dictionary.data(),
+                             dictionary.size()) == Z_OK)
+      rc = inflate(&zs, Z_FINISH);
+
+    bool ok = rc == Z_STREAM_END && zs.total_out == rawSize;
+    inflateEnd(&zs);
+    return ok;
+  }
+
+  // Builds a preset dictionary from representative samples: the most
+  // frequent substrings of segmentLength bytes, most frequent last since
+  // deflate reaches the end of the dictionary with the shortest distances
+  static std::string train(const std::vector<std::string> &samples,
+                           size_t dictSize = 16384, size_t segmentLength = 12) {
+    std::unordered_map<std::string, size_t> counts;
+    for (const std::string &sample : samples)
+      for (size_t i = 0; i + segmentLength <= sample.size(); ++i)
+        counts[sample.substr(i, segmentLength)]++;
+
+    std::vector<std::pair<std::string, size_t>> segments;
+    for (auto &c : counts)
+      if (c.second > 1)
+        segments.emplace_back(c.first, c.second);
+    std::sort(segments.begin(), segments.end(),
+              [](const auto &a, const auto &b) {
+                return a.second != b.second ? a.second > b.second
+                                            : a.first < b.first;
+              });
+
+    std::string dictionary;
+    for (const auto &s : segments) {
+      if (dictionary.size() + segmentLength > dictSize)
+        break;
+      if (dictionary.find(s.first) == std::string::npos)
+        dictionary.insert(0, s.first);
+    }
+    return dictionary;
+  }
+
+private:
+  int level;
+  std::string dictionary;
+};
+
+} // namespace SQL
+
+#endif
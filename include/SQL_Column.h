@@ -1,8 +1,12 @@
 #ifndef SQL_COLUMN
 #define SQL_COLUMN
 
+#include "SQL_Memory.h"
 #include "SQL_Value.h"
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <new>
 
 namespace SQL {
 struct Column_t {
@@ -10,7 +14,7 @@ struct Column_t {
   SqlValue *values = nullptr;
   Column_t() = default;
   Column_t(size_t rowCount) : rowCount(rowCount) {
-    values = new SqlValue[rowCount];
+    values = allocate(rowCount);
   }
   ~Column_t() { destroy(); }
 
@@ -37,24 +41,33 @@ struct Column_t {
     size_t pos = 0;
 
     for (size_t r = 0; r < rowCount; ++r) {
-      size_t need =
-          snprintf(buffer + pos, bufSize - pos, "%s\t", values[r].toString());
+      const char *text = values[r].toString();
+      size_t need = snprintf(buffer + pos, bufSize - pos, "%s\t", text);
       if (need >= bufSize - pos) {
-        bufSize *= 2;
+        bufSize = std::max(bufSize * 2, pos + need + 1);
         buffer = (char *)realloc(buffer, bufSize);
-
-        need =
-            snprintf(buffer + pos, bufSize - pos, "%s\t", values[r].toString());
+        need = snprintf(buffer + pos, bufSize - pos, "%s\t", text);
       }
+      free((void *)text);
       pos += need;
     }
     return buffer;
   }
 
 private:
+  // Pool block of count values, destroy() frees it with rowCount
+  static SqlValue *allocate(size_t count) {
+    SqlValue *array = (SqlValue *)allocateBlock(count * sizeof(SqlValue));
+    for (size_t i = 0; i < count; ++i)
+      new (array + i) SqlValue();
+    return array;
+  }
+
   void destroy() {
     if (values != nullptr) {
-      delete[] values;
+      for (size_t i = 0; i < rowCount; ++i)
+        values[i].~SqlValue();
+      releaseBlock(values);
       values = nullptr;
     }
     rowCount = 0;
@@ -62,8 +75,8 @@ private:
 
   void copy_from(const Column_t &o) {
     destroy();
+    values = allocate(o.rowCount);
     rowCount = o.rowCount;
-    values = new SqlValue[rowCount];
 
     for (size_t i = 0; i < rowCount; ++i)
       values[i] = o.values[i];
@@ -71,8 +84,8 @@ private:
 
   void move_from(Column_t &&o) noexcept {
     destroy();
+    values = allocate(o.rowCount);
     rowCount = o.rowCount;
-    values = new SqlValue[rowCount];
 
     for (size_t i = 0; i < rowCount; ++i)
       values[i] = std::move(o.values[i]);
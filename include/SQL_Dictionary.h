@@ -0,0 +1,82 @@
+#ifndef SQL_DICTIONARY_H
+#define SQL_DICTIONARY_H
+
+#include "SQL_Value.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace SQL {
+
+// String table of one Text column. Every distinct string is stored once and
+// numbered in order of first appearance, cells of the column borrow it as
+// SqlValue::interned(), so equal cells share one pointer and one code. A
+// matrix only holds its dictionaries as const, strings are never removed
+// and keep their address, so cells stay valid for the dictionary lifetime.
+class Dictionary_t {
+public:
+  Dictionary_t() = default;
+  // Cells point into strings, a copy would not own them
+  Dictionary_t(const Dictionary_t &) = delete;
+  Dictionary_t &operator=(const Dictionary_t &) = delete;
+
+  // Code of s, added when new
+  uint32_t intern(const char *s, size_t n) {
+    auto it = codes.find(std::string_view(s, n));
+    if (it != codes.end())
+      return it->second;
+
+    uint32_t code = (uint32_t)strings.size();
+    strings.emplace_back(s, n);
+    codes.emplace(std::string_view(strings.back()), code);
+    stored += n + 1;
+    return code;
+  }
+
+  // NO_DICTIONARY_CODE when s is not in the dictionary
+  uint32_t find(const char *s, size_t n) const {
+    auto it = codes.find(std::string_view(s, n));
+    return it == codes.end() ? NO_DICTIONARY_CODE : it->second;
+  }
+
+  // Code of a Text value of the column, interned or not. Interned values
+  // are trusted to come from this dictionary.
+  uint32_t codeOf(const SqlValue &v) const {
+    if (v.type() != SqlValue::Text)
+      return NO_DICTIONARY_CODE;
+    if (v.dictionaryCode() != NO_DICTIONARY_CODE)
+      return v.dictionaryCode();
+    return find(v.as_text(), v.bytes());
+  }
+
+  // Whether v borrows its text from this dictionary
+  bool owns(const SqlValue &v) const {
+    uint32_t code = v.dictionaryCode();
+    return code < strings.size() && strings[code].data() == v.as_text();
+  }
+
+  // Cell for code, borrowing the string
+  SqlValue value(uint32_t code) const {
+    const std::string &s = strings[code];
+    return SqlValue::interned(s.data(), s.size(), code);
+  }
+
+  const std::string &at(uint32_t code) const { return strings[code]; }
+
+  size_t size() const { return strings.size(); }
+
+  // Text bytes held, terminators included
+  size_t bytes() const { return stored; }
+
+private:
+  std::deque<std::string> strings; // by code, never moved
+  std::unordered_map<std::string_view, uint32_t> codes;
+  size_t stored = 0;
+};
+
+} // namespace SQL
+
+#endif
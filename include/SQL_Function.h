@@ -0,0 +1,173 @@
+#ifndef SQL_FUNCTION_H
+#define SQL_FUNCTION_H
+
+#include "SQL_Value.h"
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace SQL {
+
+// Scalar function on SqlValue arguments, argv holds argc values
+typedef std::function<SqlValue(int argc, const SqlValue *argv)>
+    ScalarFunction_t;
+
+template <typename T> struct UnsupportedSqlType_t : std::false_type {};
+
+// Reads an argument straight into a C++ type: integral types, floating
+// point, const char * (valid for the call only), std::string or SqlValue
+template <typename T> T argAs(sqlite3_value *value) {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, SqlValue>)
+    return SqlValue::from_value(value);
+  else if constexpr (std::is_same_v<U, bool>)
+    return sqlite3_value_int64(value) != 0;
+  else if constexpr (std::is_integral_v<U>)
+    return (U)sqlite3_value_int64(value);
+  else if constexpr (std::is_floating_point_v<U>)
+    return (U)sqlite3_value_double(value);
+  else if constexpr (std::is_same_v<U, const char *>)
+    return (const char *)sqlite3_value_text(value);
+  else if constexpr (std::is_same_v<U, std::string>) {
+    const char *p = (const char *)sqlite3_value_text(value);
+    return p ? std::string(p, sqlite3_value_bytes(value)) : std::string();
+  } else
+    static_assert(UnsupportedSqlType_t<U>::value, "Unsupported argument type");
+}
+
+template <typename T> void setResult(sqlite3_context *ctx, const T &r) {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, SqlValue>)
+    r.result(ctx);
+  else if constexpr (std::is_integral_v<U>)
+    sqlite3_result_int64(ctx, (sqlite3_int64)r);
+  else if constexpr (std::is_floating_point_v<U>)
+    sqlite3_result_double(ctx, (double)r);
+  else if constexpr (std::is_same_v<U, const char *> ||
+                     std::is_same_v<U, char *>) {
+    if (r == nullptr)
+      sqlite3_result_null(ctx);
+    else
+      sqlite3_result_text(ctx, r, -1, SQLITE_TRANSIENT);
+  } else if constexpr (std::is_same_v<U, std::string>)
+    sqlite3_result_text(ctx, r.data(), r.size(), SQLITE_TRANSIENT);
+  else
+    static_assert(UnsupportedSqlType_t<U>::value, "Unsupported result type");
+}
+
+// Reported for exceptions not derived from std::exception, nothing may
+// unwind through SQLite
+#define FUNCTION_UNKNOWN_ERROR "Function Error: unknown exception"
+
+// Owned by SQLite through the function's user data, deleted by xDestroy
+struct FunctionHolder_t {
+  virtual ~FunctionHolder_t() = default;
+  virtual void call(sqlite3_context *ctx, int argc, sqlite3_value **argv) = 0;
+
+  static void scalar(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    FunctionHolder_t *holder = (FunctionHolder_t *)sqlite3_user_data(ctx);
+    try {
+      holder->call(ctx, argc, argv);
+    } catch (const std::exception &e) {
+      sqlite3_result_error(ctx, e.what(), -1);
+    } catch (...) {
+      sqlite3_result_error(ctx, FUNCTION_UNKNOWN_ERROR, -1);
+    }
+  }
+
+  static void destroy(void *holder) { delete (FunctionHolder_t *)holder; }
+};
+
+struct ScalarHolder_t : FunctionHolder_t {
+  ScalarFunction_t fn;
+  ScalarHolder_t(ScalarFunction_t fn) : fn(std::move(fn)) {}
+
+  void call(sqlite3_context *ctx, int argc, sqlite3_value **argv) override {
+    std::vector<SqlValue> args(argc);
+    for (int i = 0; i < argc; ++i)
+      args[i] = SqlValue::from_value(argv[i]);
+    fn(argc, args.data()).result(ctx);
+  }
+};
+
+// Typed callable, arguments are converted without going through SqlValue
+template <typename R, typename... Args>
+struct TypedHolder_t : FunctionHolder_t {
+  std::function<R(Args...)> fn;
+  TypedHolder_t(std::function<R(Args...)> fn) : fn(std::move(fn)) {}
+
+  void call(sqlite3_context *ctx, int, sqlite3_value **argv) override {
+    callWith(ctx, argv, std::index_sequence_for<Args...>{});
+  }
+
+  template <size_t... I>
+  void callWith(sqlite3_context *ctx, sqlite3_value **argv,
+                std::index_sequence<I...>) {
+    setResult(ctx, fn(argAs<Args>(argv[I])...));
+  }
+
+  static constexpr int argCount = sizeof...(Args);
+};
+
+template <typename Sig> struct TypedHolderFor_t;
+template <typename R, typename... Args>
+struct TypedHolderFor_t<std::function<R(Args...)>> {
+  typedef TypedHolder_t<R, Args...> type;
+};
+
+// Aggregate with per-group State, created on the first row of a group
+template <typename State> struct AggregateHolder_t {
+  std::function<void(State &, int, const SqlValue *)> step;
+  std::function<SqlValue(State &)> final;
+
+  static void xStep(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    AggregateHolder_t *holder = (AggregateHolder_t *)sqlite3_user_data(ctx);
+    State **slot = (State **)sqlite3_aggregate_context(ctx, sizeof(State *));
+    if (slot == nullptr) {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+
+    try {
+      if (*slot == nullptr)
+        *slot = new State();
+
+      std::vector<SqlValue> args(argc);
+      for (int i = 0; i < argc; ++i)
+        args[i] = SqlValue::from_value(argv[i]);
+      holder->step(**slot, argc, args.data());
+    } catch (const std::exception &e) {
+      sqlite3_result_error(ctx, e.what(), -1);
+    } catch (...) {
+      sqlite3_result_error(ctx, FUNCTION_UNKNOWN_ERROR, -1);
+    }
+  }
+
+  static void xFinal(sqlite3_context *ctx) {
+    AggregateHolder_t *holder = (AggregateHolder_t *)sqlite3_user_data(ctx);
+    State **slot = (State **)sqlite3_aggregate_context(ctx, 0);
+
+    std::unique_ptr<State> state(slot != nullptr ? *slot : nullptr);
+    try {
+      // No rows in the group, finalize a fresh state
+      if (state == nullptr)
+        state.reset(new State());
+      holder->final(*state).result(ctx);
+    } catch (const std::exception &e) {
+      sqlite3_result_error(ctx, e.what(), -1);
+    } catch (...) {
+      sqlite3_result_error(ctx, FUNCTION_UNKNOWN_ERROR, -1);
+    }
+  }
+
+  static void destroy(void *holder) { delete (AggregateHolder_t *)holder; }
+};
+
+} // namespace SQL
+
+#endif
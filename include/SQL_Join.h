@@ -0,0 +1,491 @@
+#ifndef SQL_JOIN_H
+#define SQL_JOIN_H
+
+#include "SQL_Dictionary.h"
+#include "SQL_Matrix.h"
+#include "SQL_Value.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace SQL {
+
+// Below this many rows hash operators stay on the calling thread
+#define PARALLEL_HASH_MIN_ROWS (16384)
+
+enum class JoinType_t { Inner = 0, Left = 1 };
+enum class Aggregate_t { Sum = 0, Count = 1, Min = 2, Max = 3, Avg = 4 };
+
+struct AggregateSpec_t {
+  size_t col;
+  Aggregate_t fn;
+};
+
+// Whether d holds a whole number that fits a long, which i then equals
+inline bool integralReal(double d, long &i) {
+  if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0))
+    return false;
+  i = (long)d;
+  return (double)i == d;
+}
+
+// Key equality of SQL's =, an Integer equals a Real of the same number
+inline bool keyEquals(const SqlValue &a, const SqlValue &b) {
+  long i;
+  if (a.type() == SqlValue::Integer && b.type() == SqlValue::Real)
+    return integralReal(b.as_real(), i) && i == a.as_int();
+  if (a.type() == SqlValue::Real && b.type() == SqlValue::Integer)
+    return integralReal(a.as_real(), i) && i == b.as_int();
+  return a == b;
+}
+
+// Consistent with keyEquals, whole Reals hash as their Integer
+inline size_t hashValue(const SqlValue &v) {
+  long i;
+  switch (v.type()) {
+  case SqlValue::Integer:
+    return std::hash<long>{}(v.as_int());
+  case SqlValue::Real:
+    if (integralReal(v.as_real(), i))
+      return std::hash<long>{}(i);
+    return std::hash<double>{}(v.as_real());
+  case SqlValue::Text:
+  case SqlValue::Blob:
+    return std::hash<std::string_view>{}(
+        std::string_view((const char *)v.as_blob(), v.bytes()));
+  default:
+    return 0;
+  }
+}
+
+// Text found in dict hashes by its code, so interned cells skip hashing
+// their strings. Both sides of a compare need the same dict.
+inline size_t hashValue(const SqlValue &v, const Dictionary_t *dict) {
+  uint32_t code =
+      (dict != nullptr) ? dict->codeOf(v) : (uint32_t)NO_DICTIONARY_CODE;
+  if (code == NO_DICTIONARY_CODE)
+    return hashValue(v);
+  return std::hash<uint32_t>{}(code);
+}
+
+// Hashes, partitioning and key compares over a set of key columns of one
+// matrix. Keys of dictionary encoded columns hash and compare by code.
+struct KeyColumns_t {
+  const Matrix_t &matrix;
+  std::vector<size_t> cols;
+  // Per key: the column dictionary, the one codes are compared in and a
+  // map from the first to the second when they differ
+  std::vector<std::shared_ptr<const Dictionary_t>> dicts;
+  std::vector<const Dictionary_t *> codeSpace;
+  std::vector<std::vector<uint32_t>> remap;
+
+  KeyColumns_t(const Matrix_t &matrix, std::initializer_list<size_t> keys)
+      : KeyColumns_t(matrix, std::vector<size_t>(keys)) {}
+  KeyColumns_t(const Matrix_t &matrix, const std::vector<size_t> &keys)
+      : matrix(matrix) {
+    for (size_t c : keys)
+      if (c < matrix.colCount) {
+        cols.push_back(c);
+        dicts.push_back(matrix.getColumnDictionary(c));
+        codeSpace.push_back(dicts.back().get());
+      }
+    remap.resize(cols.size());
+  }
+
+  // Lets right compare by codes of the left dictionaries. Keys encoded on
+  // one side only compare text.
+  static void shareCodes(KeyColumns_t &left, KeyColumns_t &right) {
+    for (size_t k = 0; k < left.cols.size() && k < right.cols.size(); ++k) {
+      const Dictionary_t *l = left.dicts[k].get();
+      const Dictionary_t *r = right.dicts[k].get();
+      if (l == nullptr || r == nullptr) {
+        left.codeSpace[k] = right.codeSpace[k] = nullptr;
+        continue;
+      }
+      right.codeSpace[k] = l;
+      if (l == r)
+        continue;
+      right.remap[k].resize(r->size());
+      for (uint32_t code = 0; code < r->size(); ++code)
+        right.remap[k][code] = l->find(r->at(code).data(), r->at(code).size());
+    }
+  }
+
+  const SqlValue &at(size_t row, size_t k) const {
+    return matrix.getValues()[row * matrix.colCount + cols[k]];
+  }
+
+  // Code of a Text key in the code space of key k, NO_DICTIONARY_CODE for
+  // other values and strings the dictionary lacks
+  uint32_t code(size_t row, size_t k) const {
+    if (codeSpace[k] == nullptr)
+      return NO_DICTIONARY_CODE;
+    const SqlValue &v = at(row, k);
+    if (v.type() != SqlValue::Text)
+      return NO_DICTIONARY_CODE;
+
+    uint32_t c = v.dictionaryCode();
+    if (c == NO_DICTIONARY_CODE)
+      return codeSpace[k]->find(v.as_text(), v.bytes());
+    return remap[k].empty() ? c : remap[k][c];
+  }
+
+  size_t hash(size_t row) const {
+    size_t h = 0;
+    for (size_t k = 0; k < cols.size(); ++k) {
+      uint32_t c = code(row, k);
+      size_t v = (c != NO_DICTIONARY_CODE) ? std::hash<uint32_t>{}(c)
+                                           : hashValue(at(row, k));
+      h ^= v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+    }
+    return h;
+  }
+
+  // SQL semantics, a Null key never matches anything
+  bool hasNull(size_t row) const {
+    for (size_t k = 0; k < cols.size(); ++k)
+      if (at(row, k).type() == SqlValue::Null)
+        return true;
+    return false;
+  }
+
+  // A string in the code space never equals one outside of it
+  bool equal(size_t row, const KeyColumns_t &other, size_t otherRow) const {
+    for (size_t k = 0; k < cols.size(); ++k) {
+      uint32_t a = code(row, k);
+      uint32_t b = other.code(otherRow, k);
+      if (a != NO_DICTIONARY_CODE || b != NO_DICTIONARY_CODE) {
+        if (a != b)
+          return false;
+      } else if (!keyEquals(at(row, k), other.at(otherRow, k))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Row indices split by hash into partitionCount lists, each list ascending
+  std::vector<std::vector<size_t>> partition(std::vector<size_t> &hashes,
+                                             size_t partitionCount) const {
+    hashes.resize(matrix.rowCount);
+    runPartitioned(partitionCount, [&](size_t t) {
+      const size_t end = matrix.rowCount * (t + 1) / partitionCount;
+      for (size_t r = matrix.rowCount * t / partitionCount; r < end; ++r)
+        hashes[r] = hash(r);
+    });
+
+    std::vector<std::vector<size_t>> parts(partitionCount);
+    for (size_t r = 0; r < matrix.rowCount; ++r)
+      parts[hashes[r] % partitionCount].push_back(r);
+    return parts;
+  }
+
+  static size_t threadCount(size_t rowCount) {
+    size_t threads = std::thread::hardware_concurrency();
+    if (rowCount < PARALLEL_HASH_MIN_ROWS || threads < 2)
+      return 1;
+    return threads;
+  }
+
+  static void runPartitioned(size_t partitionCount,
+                             const std::function<void(size_t)> &work) {
+    if (partitionCount == 1) {
+      work(0);
+      return;
+    }
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < partitionCount; ++t)
+      workers.emplace_back(work, t);
+    for (std::thread &t : workers)
+      t.join();
+  }
+};
+
+inline void setTruncatedColumnName(Matrix_t &matrix, size_t cIdx,
+                                   const char *colName) {
+  char buffer[MAX_COLUMN_NAME_LENGTH];
+  snprintf(buffer, MAX_COLUMN_NAME_LENGTH, "%s", colName);
+  matrix.setColumnName(buffer, cIdx);
+}
+
+// Joins left and right on equal key columns (leftKeys[i] = rightKeys[i]).
+// The result holds every left column followed by every right column, in
+// left row order. Rows are matched on row indices inside per-thread hash
+// partitions, so values are only copied once into the result. Keys built
+// at run time go in vectors.
+inline Matrix_t hashJoin(const Matrix_t &left,
+                         const std::vector<size_t> &leftKeys,
+                         const Matrix_t &right,
+                         const std::vector<size_t> &rightKeys,
+                         JoinType_t type = JoinType_t::Inner) {
+  const size_t noMatch = (size_t)-1;
+  KeyColumns_t lk(left, leftKeys);
+  KeyColumns_t rk(right, rightKeys);
+  KeyColumns_t::shareCodes(lk, rk);
+  std::vector<std::pair<size_t, size_t>> matches;
+
+  if (lk.cols.size() == rk.cols.size() && !lk.cols.empty() &&
+      left.getValues() != nullptr && right.getValues() != nullptr) {
+    const size_t parts = KeyColumns_t::threadCount(
+        std::max(left.rowCount, right.rowCount));
+    std::vector<size_t> lHashes, rHashes;
+    auto lParts = lk.partition(lHashes, parts);
+    auto rParts = rk.partition(rHashes, parts);
+
+    std::vector<std::vector<std::pair<size_t, size_t>>> partMatches(parts);
+    KeyColumns_t::runPartitioned(parts, [&](size_t p) {
+      // Build on the right side, probe with the left
+      std::unordered_multimap<size_t, size_t> table;
+      table.reserve(rParts[p].size());
+      for (size_t r : rParts[p])
+        if (!rk.hasNull(r))
+          table.emplace(rHashes[r], r);
+
+      for (size_t l : lParts[p]) {
+        bool matched = false;
+        if (!lk.hasNull(l)) {
+          auto range = table.equal_range(lHashes[l]);
+          for (auto it = range.first; it != range.second; ++it)
+            if (lk.equal(l, rk, it->second)) {
+              partMatches[p].emplace_back(l, it->second);
+              matched = true;
+            }
+        }
+        if (!matched && type == JoinType_t::Left)
+          partMatches[p].emplace_back(l, noMatch);
+      }
+    });
+
+    for (auto &m : partMatches)
+      matches.insert(matches.end(), m.begin(), m.end());
+    std::sort(matches.begin(), matches.end());
+  }
+
+  const size_t colCount = left.colCount + right.colCount;
+  Matrix_t joined = Matrix_t(colCount, matches.empty() ? 1 : matches.size());
+  snprintf(joined.name, MAX_TABLE_NAME_LENGTH, "%s", left.name);
+  for (size_t c = 0; c < left.colCount; ++c) {
+    setTruncatedColumnName(joined, c, left.getColumnName(c));
+    joined.setColumnDictionary(c, left.getColumnDictionary(c));
+  }
+  for (size_t c = 0; c < right.colCount; ++c) {
+    setTruncatedColumnName(joined, left.colCount + c,
+                           right.getColumnName(c));
+    joined.setColumnDictionary(left.colCount + c,
+                               right.getColumnDictionary(c));
+  }
+
+  SqlValue *cells = joined.editValues();
+  for (size_t i = 0; i < matches.size(); ++i) {
+    SqlValue *out = cells + i * colCount;
+    const SqlValue *l = left.getValues() + matches[i].first * left.colCount;
+    for (size_t c = 0; c < left.colCount; ++c)
+      out[c].share(l[c]);
+
+    if (matches[i].second == noMatch)
+      continue; // right side stays Null
+    const SqlValue *r =
+        right.getValues() + matches[i].second * right.colCount;
+    for (size_t c = 0; c < right.colCount; ++c)
+      out[left.colCount + c].share(r[c]);
+  }
+  joined.rowCount = matches.size();
+  return joined;
+}
+inline Matrix_t hashJoin(const Matrix_t &left,
+                         std::initializer_list<size_t> leftKeys,
+                         const Matrix_t &right,
+                         std::initializer_list<size_t> rightKeys,
+                         JoinType_t type = JoinType_t::Inner) {
+  return hashJoin(left, std::vector<size_t>(leftKeys), right,
+                  std::vector<size_t>(rightKeys), type);
+}
+
+// Number a Text or Blob stands for in Sum and Avg, like SQLite: its leading
+// decimal number, 0 when there is none
+inline double textToNumber(const SqlValue &v) {
+  std::string text((const char *)v.as_blob(), v.bytes());
+  const char *s = text.c_str();
+  while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+    ++s;
+  const char *digits = s + (*s == '+' || *s == '-');
+  // strtod also reads hex, inf and nan, SQLite does not
+  if (!((*digits >= '0' && *digits <= '9') || *digits == '.') ||
+      (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')))
+    return 0;
+  return strtod(s, nullptr);
+}
+
+// Groups rows on the key columns and computes the aggregates per group. The
+// result holds the key columns followed by one column per aggregate, named
+// like "sum(value)", with groups in order of first appearance. Keys group
+// like SQL's =, so Integer 1 and Real 1.0 fall in one group. Null values
+// are skipped by every aggregate, Sum of only Integers stays Integer. Text
+// and Blob values count in Sum and Avg as textToNumber and make Sum Real.
+// Min and Max order like SQLite, see SqlValue::compare. An Integer Sum
+// that overflows throws, as sum() fails with "integer overflow".
+inline Matrix_t hashGroupBy(const Matrix_t &matrix,
+                            const std::vector<size_t> &keyCols,
+                            const std::vector<AggregateSpec_t> &aggregates) {
+  struct Accumulator {
+    long count = 0;
+    long isum = 0;
+    double dsum = 0;
+    bool real = false;
+    bool overflow = false; // isum overflowed while still Integer
+    size_t minRow = (size_t)-1;
+    size_t maxRow = (size_t)-1;
+  };
+  struct Group {
+    size_t firstRow;
+    std::vector<Accumulator> acc;
+  };
+
+  KeyColumns_t keys(matrix, keyCols);
+  std::vector<AggregateSpec_t> aggs;
+  for (const AggregateSpec_t &a : aggregates)
+    if (a.col < matrix.colCount)
+      aggs.push_back(a);
+
+  auto valueAt = [&](size_t row, size_t col) -> const SqlValue & {
+    return matrix.getValues()[row * matrix.colCount + col];
+  };
+
+  std::vector<Group> groups;
+  if (matrix.getValues() != nullptr && matrix.rowCount > 0) {
+    const size_t parts = KeyColumns_t::threadCount(matrix.rowCount);
+    std::vector<size_t> hashes;
+    auto rowParts = keys.partition(hashes, parts);
+
+    std::vector<std::vector<Group>> partGroups(parts);
+    KeyColumns_t::runPartitioned(parts, [&](size_t p) {
+      std::unordered_multimap<size_t, size_t> table; // hash -> group
+      std::vector<Group> &local = partGroups[p];
+
+      for (size_t r : rowParts[p]) {
+        size_t g = (size_t)-1;
+        auto range = table.equal_range(hashes[r]);
+        for (auto it = range.first; it != range.second; ++it)
+          if (keys.equal(r, keys, local[it->second].firstRow)) {
+            g = it->second;
+            break;
+          }
+        if (g == (size_t)-1) {
+          g = local.size();
+          local.push_back(Group{r, std::vector<Accumulator>(aggs.size())});
+          table.emplace(hashes[r], g);
+        }
+
+        for (size_t a = 0; a < aggs.size(); ++a) {
+          const SqlValue &v = valueAt(r, aggs[a].col);
+          if (v.type() == SqlValue::Null)
+            continue;
+
+          Accumulator &acc = local[g].acc[a];
+          acc.count++;
+          if (v.type() == SqlValue::Integer) {
+            if (!acc.real && !acc.overflow &&
+                __builtin_add_overflow(acc.isum, v.as_int(), &acc.isum))
+              acc.overflow = true;
+            acc.dsum += (double)v.as_int();
+          } else if (v.type() == SqlValue::Real) {
+            acc.dsum += v.as_real();
+            acc.real = true;
+          } else {
+            acc.dsum += textToNumber(v);
+            acc.real = true;
+          }
+          if (acc.minRow == (size_t)-1 ||
+              v.compare(valueAt(acc.minRow, aggs[a].col)) < 0)
+            acc.minRow = r;
+          if (acc.maxRow == (size_t)-1 ||
+              v.compare(valueAt(acc.maxRow, aggs[a].col)) > 0)
+            acc.maxRow = r;
+        }
+      }
+    });
+
+    for (auto &g : partGroups)
+      std::move(g.begin(), g.end(), std::back_inserter(groups));
+    std::sort(groups.begin(), groups.end(),
+              [](const Group &a, const Group &b) {
+                return a.firstRow < b.firstRow;
+              });
+  }
+
+  const char *fnNames[] = {"sum", "count", "min", "max", "avg"};
+  const size_t colCount = keys.cols.size() + aggs.size();
+  Matrix_t grouped = Matrix_t(colCount, groups.empty() ? 1 : groups.size());
+  snprintf(grouped.name, MAX_TABLE_NAME_LENGTH, "%s", matrix.name);
+  for (size_t k = 0; k < keys.cols.size(); ++k) {
+    setTruncatedColumnName(grouped, k, matrix.getColumnName(keys.cols[k]));
+    grouped.setColumnDictionary(k, keys.dicts[k]);
+  }
+  for (size_t a = 0; a < aggs.size(); ++a) {
+    char colName[MAX_COLUMN_NAME_LENGTH];
+    snprintf(colName, MAX_COLUMN_NAME_LENGTH, "%s(%s)",
+             fnNames[(size_t)aggs[a].fn], matrix.getColumnName(aggs[a].col));
+    setTruncatedColumnName(grouped, keys.cols.size() + a, colName);
+  }
+
+  SqlValue *cells = grouped.editValues();
+  for (size_t g = 0; g < groups.size(); ++g) {
+    SqlValue *out = cells + g * colCount;
+    for (size_t k = 0; k < keys.cols.size(); ++k)
+      out[k].share(keys.at(groups[g].firstRow, k));
+
+    for (size_t a = 0; a < aggs.size(); ++a) {
+      const Accumulator &acc = groups[g].acc[a];
+      SqlValue &v = out[keys.cols.size() + a];
+      if (aggs[a].fn == Aggregate_t::Count) {
+        v = SqlValue(acc.count);
+        continue;
+      }
+      if (acc.count == 0)
+        continue; // Null
+
+      switch (aggs[a].fn) {
+      case Aggregate_t::Sum:
+        if (acc.overflow)
+          throw std::runtime_error("GroupBy Error: integer overflow");
+        v = acc.real ? SqlValue(acc.dsum) : SqlValue(acc.isum);
+        break;
+      case Aggregate_t::Avg:
+        v = SqlValue(acc.dsum / (double)acc.count);
+        break;
+      case Aggregate_t::Min:
+        v = valueAt(acc.minRow, aggs[a].col);
+        break;
+      case Aggregate_t::Max:
+        v = valueAt(acc.maxRow, aggs[a].col);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+  grouped.rowCount = groups.size();
+  return grouped;
+}
+inline Matrix_t hashGroupBy(const Matrix_t &matrix,
+                            std::initializer_list<size_t> keyCols,
+                            std::initializer_list<AggregateSpec_t> aggregates) {
+  return hashGroupBy(matrix, std::vector<size_t>(keyCols),
+                     std::vector<AggregateSpec_t>(aggregates));
+}
+
+} // namespace SQL
+
+#endif
@@ -2,13 +2,21 @@
 #define SQL_DATATYPES_H_
 
 #include "SQL_Column.h"
+#include "SQL_Dictionary.h"
+#include "SQL_Memory.h"
 #include "SQL_Row.h"
+#include "SQL_Shared.h"
+#include "SQL_Sort.h"
 #include "SQL_Value.h"
+#include <algorithm>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <initializer_list>
+#include <memory>
 #include <sched.h>
+#include <vector>
 
 namespace SQL {
 
@@ -16,9 +24,7 @@ struct Matrix_t {
 
   size_t colCount = 0;
   size_t rowCount = 0;
-  char name[MAX_TABLE_NAME_LENGTH];
-  SqlValue *values = nullptr;
-  char *columnNames = nullptr;
+  char name[MAX_TABLE_NAME_LENGTH] = "";
 
   // default constructor
   Matrix_t() = default;
@@ -79,10 +85,10 @@ struct Matrix_t {
 
     SqlValue *cpy_ptr = values;
     cpy_ptr += rIdx * colCount;
+    SqlValue *cells = r.editValues();
     for (size_t i = 0; i < colCount; ++i)
-      r.values[i] = *(cpy_ptr + i);
+      cells[i] = *(cpy_ptr + i);
 
-    free(cpy_ptr);
     return r;
   }
 
@@ -90,19 +96,51 @@ struct Matrix_t {
     if (r.colCount != colCount)
       return;
 
-    if (rowCount >= capacity) {
-      Matrix_t cpy = *this;
-      cpy.capacity *= 2;
-      copy_from(cpy);
+    if (rowCount >= capacity)
+      reallocate(capacity ? capacity * 2 : 1);
+    else if (!ownedAlone(valueBuffer))
+      reallocate(capacity);
+
+    // A row nobody else holds gives its values up
+    bool steal = !r.shared();
+    SqlValue *taken = steal ? r.editValues() : nullptr;
+    for (size_t i = 0; i < colCount; ++i) {
+      SqlValue &cell = values[rowCount * colCount + i];
+      if (steal)
+        cell = std::move(taken[i]);
+      else
+        cell = r.getValues()[i];
+
+      // Text interned elsewhere could outlive its dictionary
+      if (cell.dictionaryCode() != NO_DICTIONARY_CODE &&
+          !(i < dictionaries.size() && dictionaries[i] &&
+            dictionaries[i]->owns(cell)))
+        cell = SqlValue(cell.as_text(), cell.bytes());
     }
 
-    SqlValue *write_ptr = values;
-    for (size_t i = 0; i < colCount; ++i)
-      values[rowCount * colCount + i] = r.values[i];
-
     rowCount++;
   }
 
+  // Copies share their values and column names until one of them changes,
+  // so the row major values are read through getValues() and written
+  // through editValues(), which detaches this matrix from its copies first.
+  // The other methods detach on their own.
+  const SqlValue *getValues() const { return values; }
+  SqlValue *editValues() {
+    detach();
+    return values;
+  }
+
+  void detach() {
+    if (!ownedAlone(valueBuffer))
+      reallocate(capacity);
+    detachNames();
+  }
+
+  bool shared() const {
+    return valueBuffer.use_count() > 1 || nameBuffer.use_count() > 1;
+  }
+
   Column_t getColumn(size_t cIdx) {
     if (cIdx >= colCount || values == nullptr)
       return Column_t();
@@ -117,8 +155,8 @@ struct Matrix_t {
     return c;
   }
 
-  const char *getColumnName(size_t cIdx) {
-    if (cIdx >= colCount)
+  const char *getColumnName(size_t cIdx) const {
+    if (cIdx >= colCount || columnNames == nullptr)
       return "";
 
     return columnNames + (cIdx * MAX_COLUMN_NAME_LENGTH);
@@ -128,7 +166,126 @@ struct Matrix_t {
     if (cIdx >= colCount)
       return;
 
-    strcpy(columnNames + (cIdx * MAX_COLUMN_NAME_LENGTH), colName);
+    detachNames();
+    snprintf(columnNames + (cIdx * MAX_COLUMN_NAME_LENGTH),
+             MAX_COLUMN_NAME_LENGTH, "%s", colName);
+  }
+
+  // Row order for the sort keys without moving any values, row i of the
+  // sorted view is getRow(index[i])
+  std::vector<size_t> sortedIndex(const std::vector<SortKey_t> &keys) const {
+    std::vector<size_t> index(rowCount);
+    std::iota(index.begin(), index.end(), 0);
+    if (values == nullptr)
+      return index;
+
+    RowComparator_t cmp(values, colCount, rowCount, keys.data(), keys.size());
+    parallelSort(index, cmp);
+    return index;
+  }
+  std::vector<size_t> sortedIndex(std::initializer_list<SortKey_t> keys) const {
+    return sortedIndex(std::vector<SortKey_t>(keys));
+  }
+
+  // Sorts the rows in place, e.g. sortBy({{2, false}, {0}}) for column 2
+  // descending then column 0 ascending. Keys built at run time, say from an
+  // ORDER BY, go in a vector.
+  void sortBy(const std::vector<SortKey_t> &keys) {
+    permute(sortedIndex(keys));
+  }
+  void sortBy(std::initializer_list<SortKey_t> keys) {
+    sortBy(std::vector<SortKey_t>(keys));
+  }
+
+  // The first k rows in sorted order as a new matrix, this one is untouched
+  Matrix_t topK(size_t k, const std::vector<SortKey_t> &keys) const {
+    std::vector<size_t> index;
+    if (values != nullptr) {
+      RowComparator_t cmp(values, colCount, rowCount, keys.data(),
+                          keys.size());
+      index = topKIndex(rowCount, k, cmp);
+    }
+
+    Matrix_t top;
+    strcpy(top.name, name);
+    top.create(colCount, index.empty() ? 1 : index.size());
+    if (columnNames != nullptr)
+      memcpy(top.columnNames, columnNames, colCount * MAX_COLUMN_NAME_LENGTH);
+    top.codecs = codecs;
+
+    top.dictionaries = dictionaries;
+
+    for (size_t r = 0; r < index.size(); ++r)
+      for (size_t c = 0; c < colCount; ++c)
+        top.values[r * colCount + c].share(values[index[r] * colCount + c]);
+    top.rowCount = index.size();
+    return top;
+  }
+  Matrix_t topK(size_t k, std::initializer_list<SortKey_t> keys) const {
+    return topK(k, std::vector<SortKey_t>(keys));
+  }
+
+  // Marks a Text/Blob column as compressed with codec, nullptr clears it
+  void setColumnCodec(size_t cIdx, std::shared_ptr<const Codec_t> codec) {
+    if (cIdx >= colCount)
+      return;
+    if (codecs.size() < colCount)
+      codecs.resize(colCount);
+    codecs[cIdx] = std::move(codec);
+  }
+
+  std::shared_ptr<const Codec_t> getColumnCodec(size_t cIdx) const {
+    if (cIdx >= codecs.size())
+      return nullptr;
+    return codecs[cIdx];
+  }
+
+  // Interns the Text cells of a column into a new dictionary, see
+  // Dictionary_t. Cells written directly later stay plain, appended rows
+  // too; encode again to fold them in.
+  void encodeColumn(size_t cIdx) {
+    if (cIdx >= colCount || values == nullptr)
+      return;
+    detach();
+
+    std::shared_ptr<Dictionary_t> dict = std::make_shared<Dictionary_t>();
+    for (size_t r = 0; r < rowCount; ++r) {
+      SqlValue &cell = values[r * colCount + cIdx];
+      if (cell.type() == SqlValue::Text)
+        cell = dict->value(dict->intern(cell.as_text(), cell.bytes()));
+    }
+    // The previous dictionary, if any, is released only now
+    if (dictionaries.size() < colCount)
+      dictionaries.resize(colCount);
+    dictionaries[cIdx] = std::move(dict);
+  }
+
+  // Attaches a dictionary to fill the column from, cells interned from
+  // another one get their own copy of the text
+  void setColumnDictionary(size_t cIdx,
+                           std::shared_ptr<const Dictionary_t> dict) {
+    if (cIdx >= colCount)
+      return;
+    if (dictionaries.size() < colCount)
+      dictionaries.resize(colCount);
+    if (dictionaries[cIdx] == dict)
+      return;
+
+    detach();
+    for (size_t r = 0; r < rowCount; ++r) {
+      SqlValue &cell = values[r * colCount + cIdx];
+      if (cell.dictionaryCode() != NO_DICTIONARY_CODE &&
+          !(dict && dict->owns(cell)))
+        cell = SqlValue(cell.as_text(), cell.bytes());
+    }
+    dictionaries[cIdx] = std::move(dict);
+  }
+
+  // nullptr for columns that are not encoded
+  std::shared_ptr<const Dictionary_t> getColumnDictionary(size_t cIdx) const {
+    if (cIdx >= dictionaries.size())
+      return nullptr;
+    return dictionaries[cIdx];
   }
 
   const char *getSQLColumnNamesString() {
@@ -138,9 +295,11 @@ struct Matrix_t {
     const char *fmt_str = "%s,";
     const char *last_fmt_str = "%s";
 
+    size_t pos = 0;
+    buffer[0] = '\0';
     for (size_t c = 0; c < colCount; ++c)
-      sprintf(buffer + (c * MAX_COLUMN_NAME_LENGTH),
-              (c == colCount - 1) ? fmt_str : last_fmt_str, getColumnName(c));
+      pos += sprintf(buffer + pos, (c == colCount - 1) ? last_fmt_str : fmt_str,
+                     getColumnName(c));
 
     return buffer;
   }
@@ -151,16 +310,16 @@ struct Matrix_t {
 
     size_t pos = 0;
     for (size_t r = 0; r < rowCount; ++r) {
-      size_t need =
-          snprintf(buffer + pos, bufSize - pos, "%s\n", getRow(r).toString());
+      const char *text = getRow(r).toString();
+      size_t need = snprintf(buffer + pos, bufSize - pos, "%s\n", text);
 
       if (need >= bufSize - pos) {
-        bufSize *= 2;
+        bufSize = std::max(bufSize * 2, pos + need + 1);
         buffer = (char *)realloc(buffer, bufSize);
 
-        need =
-            snprintf(buffer + pos, bufSize - pos, "%s\n", getRow(r).toString());
+        need = snprintf(buffer + pos, bufSize - pos, "%s\n", text);
       }
+      free((void *)text);
       pos += need;
     }
 
@@ -168,12 +327,70 @@ struct Matrix_t {
   }
 
 private:
+  SqlValue *values = nullptr;  // into valueBuffer
+  char *columnNames = nullptr; // into nameBuffer
   size_t capacity = 1;
+  std::shared_ptr<SqlValue[]> valueBuffer;
+  std::shared_ptr<char[]> nameBuffer;
+  std::vector<std::shared_ptr<const Codec_t>> codecs;
+  // Kept alive for the interned cells of the columns
+  std::vector<std::shared_ptr<const Dictionary_t>> dictionaries;
 
   void create(size_t colCount, size_t capacity) {
     this->colCount = colCount;
-    this->values = new SqlValue[capacity * colCount];
-    this->columnNames = new char[colCount * MAX_COLUMN_NAME_LENGTH];
+    this->capacity = capacity;
+    valueBuffer = makePooledArray<SqlValue>(capacity * colCount);
+    nameBuffer = makePooledArray<char>(colCount * MAX_COLUMN_NAME_LENGTH);
+    this->values = valueBuffer.get();
+    this->columnNames = nameBuffer.get();
+  }
+
+  // New private buffer of newCapacity rows, values are moved when nobody
+  // else shares the old one
+  void reallocate(size_t newCapacity) {
+    std::shared_ptr<SqlValue[]> grown =
+        makePooledArray<SqlValue>(newCapacity * colCount);
+    bool steal = ownedAlone(valueBuffer);
+    for (size_t i = 0; i < rowCount * colCount; ++i) {
+      if (steal)
+        grown[i] = std::move(values[i]);
+      else
+        grown[i].share(values[i]);
+    }
+    valueBuffer = std::move(grown);
+    values = valueBuffer.get();
+    capacity = newCapacity;
+  }
+
+  void detachNames() {
+    if (ownedAlone(nameBuffer))
+      return;
+    std::shared_ptr<char[]> names =
+        makePooledArray<char>(colCount * MAX_COLUMN_NAME_LENGTH);
+    memcpy(names.get(), columnNames, colCount * MAX_COLUMN_NAME_LENGTH);
+    nameBuffer = std::move(names);
+    columnNames = nameBuffer.get();
+  }
+
+  // Places every row once into its sorted position
+  void permute(const std::vector<size_t> &index) {
+    if (values == nullptr || index.size() != rowCount)
+      return;
+
+    std::shared_ptr<SqlValue[]> sorted =
+        makePooledArray<SqlValue>(capacity * colCount);
+    bool steal = ownedAlone(valueBuffer);
+    for (size_t r = 0; r < rowCount; ++r)
+      for (size_t c = 0; c < colCount; ++c) {
+        SqlValue &v = values[index[r] * colCount + c];
+        if (steal)
+          sorted[r * colCount + c] = std::move(v);
+        else
+          sorted[r * colCount + c].share(v);
+      }
+
+    valueBuffer = std::move(sorted);
+    values = valueBuffer.get();
   }
 
   void copy_names(char *columnNames, size_t count) {
@@ -184,29 +401,31 @@ private:
   }
 
   void destroy() {
-    if (values != nullptr) {
-      delete[] values;
-      values = nullptr;
-    }
-    if (columnNames != nullptr) {
-      delete[] columnNames;
-      columnNames = nullptr;
-    }
+    valueBuffer.reset();
+    nameBuffer.reset();
+    values = nullptr;
+    columnNames = nullptr;
     sprintf(name, "");
+    codecs.clear();
+    dictionaries.clear();
     colCount = 0;
     rowCount = 0;
     capacity = 0;
   }
 
+  // O(1), values and names are shared until one side detaches
   void copy_from(const Matrix_t &o) {
     destroy();
     rowCount = o.rowCount;
     colCount = o.colCount;
     capacity = o.capacity;
     strcpy(name, o.name);
-    create(o.colCount, o.capacity);
-    memcpy((void *)values, o.values, sizeof(SqlValue) * colCount * rowCount);
-    copy_names(o.columnNames, o.colCount);
+    valueBuffer = o.valueBuffer;
+    nameBuffer = o.nameBuffer;
+    values = o.values;
+    columnNames = o.columnNames;
+    codecs = o.codecs;
+    dictionaries = o.dictionaries;
   }
 
   void move_from(Matrix_t &&o) noexcept {
@@ -215,9 +434,12 @@ private:
     colCount = o.colCount;
     capacity = o.capacity;
     strcpy(name, o.name);
-    create(o.colCount, o.capacity);
-    values = std::move(o.values);
-    columnNames = std::move(o.columnNames);
+    valueBuffer = std::move(o.valueBuffer);
+    nameBuffer = std::move(o.nameBuffer);
+    values = o.values;
+    columnNames = o.columnNames;
+    codecs = std::move(o.codecs);
+    dictionaries = std::move(o.dictionaries);
     o.destroy();
   }
 };
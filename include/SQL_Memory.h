@@ -0,0 +1,428 @@
+#ifndef SQL_MEMORY_H
+#define SQL_MEMORY_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sqlite3.h>
+#include <stdexcept>
+
+namespace SQL {
+
+// Size classes of the pools, in block bytes with the header
+#define MEMORY_POOL_CLASSES (18)
+#define MEMORY_HEADER_SIZE (16)
+// Bytes taken from the system at once to cut into blocks of one class
+#define MEMORY_SLAB_SIZE (65536)
+// Blocks a thread cache moves from or to the shared lists at once
+#define MEMORY_POOL_BATCH (32)
+// Thread caches publish their usage counters after this many bytes
+#define MEMORY_STATS_FLUSH (65536)
+
+// Sanitizers only see separate malloc blocks, so there every allocation
+// skips the pools, just like with SQL_SYSTEM_MALLOC. Accounting still works.
+#if defined(__SANITIZE_ADDRESS__) || defined(SQL_SYSTEM_MALLOC)
+#define MEMORY_POOL_BYPASS
+#endif
+
+class MemoryPool_t;
+inline MemoryPool_t &memoryPool();
+
+struct MemoryStats_t {
+  size_t bytesInUse = 0;    // blocks handed out, headers and rounding in
+  size_t peakBytes = 0;     // highest bytesInUse seen
+  size_t blocksInUse = 0;   // not released yet, leaks when left at exit
+  uint64_t allocations = 0; // since start
+  uint64_t failures = 0;    // refused by the limit or the system
+  size_t reservedBytes = 0; // taken from the system, pools and large blocks
+  size_t limit = 0;         // 0 is unlimited
+};
+
+// Pools of fixed size blocks for every class up to 8 KiB, larger blocks
+// come from malloc. Each thread keeps a cache of free blocks per class
+// and only locks a shared list to move a batch, so threads do not contend
+// on most allocations. Freed blocks go to the cache of the freeing thread.
+// Slabs are kept for reuse and never returned to the system.
+//
+// Counters are published from the thread caches every MEMORY_STATS_FLUSH
+// bytes, so stats() and the limit may lag by that much per thread.
+class MemoryPool_t {
+public:
+  // nullptr when over the limit or out of memory, 16 byte aligned
+  void *allocate(size_t n) {
+    size_t need = n + MEMORY_HEADER_SIZE;
+    int sizeClass = classOf(need);
+    size_t block = (sizeClass < 0) ? need : classSizes[sizeClass];
+    ThreadCache_t *cache = threadCache();
+
+    size_t max = limit.load(std::memory_order_relaxed);
+    long pending = cache ? cache->counters.bytes : 0;
+    if (max != 0 &&
+        (long)inUse.load(std::memory_order_relaxed) + pending + (long)block >
+            (long)max) {
+      failures.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Header_t *header;
+    if (sizeClass < 0) {
+      header = (Header_t *)malloc(block);
+      if (header != nullptr)
+        reserved.fetch_add(block, std::memory_order_relaxed);
+    } else {
+      header = (Header_t *)take(sizeClass, cache);
+    }
+    if (header == nullptr) {
+      failures.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    header->size = block;
+    header->sizeClass = sizeClass;
+    count(cache, (long)block, 1, 1);
+    return header + 1;
+  }
+
+  void release(void *p) {
+    if (p == nullptr)
+      return;
+    Header_t *header = (Header_t *)p - 1;
+    size_t block = header->size;
+    ThreadCache_t *cache = threadCache();
+
+    if (header->sizeClass < 0) {
+      free(header);
+      reserved.fetch_sub(block, std::memory_order_relaxed);
+    } else {
+      give(header->sizeClass, (FreeBlock_t *)header, cache);
+    }
+    count(cache, -(long)block, -1, 0);
+  }
+
+  // Bytes usable at p, at least what was asked for
+  size_t usableSize(const void *p) const {
+    return ((const Header_t *)p - 1)->size - MEMORY_HEADER_SIZE;
+  }
+
+  // realloc semantics, p is kept when it already has room
+  void *reallocate(void *p, size_t n) {
+    if (p == nullptr)
+      return allocate(n);
+    size_t have = usableSize(p);
+    if (n <= have && classOf(n + MEMORY_HEADER_SIZE) ==
+                         ((Header_t *)p - 1)->sizeClass)
+      return p;
+
+    void *grown = allocate(n);
+    if (grown == nullptr)
+      return nullptr;
+    memcpy(grown, p, std::min(n, have));
+    release(p);
+    return grown;
+  }
+
+  // Usable size an allocation of n bytes ends up with
+  static size_t roundUp(size_t n) {
+    int sizeClass = classOf(n + MEMORY_HEADER_SIZE);
+    if (sizeClass < 0)
+      return (n + 7) & ~(size_t)7;
+    return classSizes[sizeClass] - MEMORY_HEADER_SIZE;
+  }
+
+  // Caps bytesInUse, SQLite then gets SQLITE_NOMEM and wrapper types
+  // std::bad_alloc. 0 removes the cap. Only blocks in use count: slabs are
+  // never returned to the system, so reservedBytes stays at its peak.
+  void setLimit(size_t bytes) {
+    limit.store(bytes, std::memory_order_relaxed);
+  }
+
+  // Includes the calling thread, other threads up to MEMORY_STATS_FLUSH
+  MemoryStats_t stats() {
+    ThreadCache_t *cache = threadCache();
+    if (cache != nullptr)
+      publish(cache->counters);
+
+    MemoryStats_t s;
+    s.bytesInUse = inUse.load(std::memory_order_relaxed);
+    s.peakBytes = peak.load(std::memory_order_relaxed);
+    s.blocksInUse = blocks.load(std::memory_order_relaxed);
+    s.allocations = allocations.load(std::memory_order_relaxed);
+    s.failures = failures.load(std::memory_order_relaxed);
+    s.reservedBytes = reserved.load(std::memory_order_relaxed);
+    s.limit = limit.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  // Makes the pool SQLite's allocator. With pageCount, the page cache
+  // first uses pageCount slots for pages up to pageSize, cut from one
+  // block. Has to run before the first connection opens (or after
+  // sqlite3_shutdown).
+  void installInSQLite(int pageSize = 4096, int pageCount = 0) {
+    static sqlite3_mem_methods methods = {
+        [](int n) -> void * { return memoryPool().allocate((size_t)n); },
+        [](void *p) { memoryPool().release(p); },
+        [](void *p, int n) -> void * {
+          return memoryPool().reallocate(p, (size_t)n);
+        },
+        [](void *p) -> int { return (int)memoryPool().usableSize(p); },
+        [](int n) -> int { return (int)MemoryPool_t::roundUp((size_t)n); },
+        [](void *) -> int { return SQLITE_OK; },
+        [](void *) {},
+        nullptr};
+
+    if (sqlite3_config(SQLITE_CONFIG_MALLOC, &methods) != SQLITE_OK)
+      throw std::runtime_error(
+          "Memory Error: SQLite is already initialized");
+    if (pageCount <= 0)
+      return;
+
+    int header = 0;
+    sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &header);
+    size_t slot = (size_t)pageSize + header;
+    void *pages = allocate(slot * pageCount);
+    if (pages == nullptr ||
+        sqlite3_config(SQLITE_CONFIG_PAGECACHE, pages, (int)slot,
+                       pageCount) != SQLITE_OK) {
+      release(pages);
+      throw std::runtime_error("Memory Error: page cache not installed");
+    }
+  }
+
+  friend MemoryPool_t &memoryPool();
+
+private:
+  struct Header_t {
+    size_t size;   // block bytes
+    long sizeClass; // -1 for malloc blocks
+  };
+  static_assert(sizeof(Header_t) == MEMORY_HEADER_SIZE, "header size");
+
+  struct FreeBlock_t {
+    FreeBlock_t *next;
+  };
+
+  struct Shared_t {
+    std::mutex lock;
+    FreeBlock_t *head = nullptr;
+  };
+
+  // Usage not published yet
+  struct Counters_t {
+    long bytes = 0;
+    long blocks = 0;
+    uint64_t allocations = 0;
+  };
+
+  struct ThreadCache_t {
+    FreeBlock_t *head[MEMORY_POOL_CLASSES] = {};
+    size_t count[MEMORY_POOL_CLASSES] = {};
+    Counters_t counters;
+
+    // Blocks and counters go back to the pool when the thread ends
+    ~ThreadCache_t() {
+      MemoryPool_t &pool = memoryPool();
+      for (int c = 0; c < MEMORY_POOL_CLASSES; ++c)
+        pool.flush(c, this, count[c]);
+      pool.publish(counters);
+      cacheGone = true;
+    }
+  };
+
+  static constexpr size_t classSizes[MEMORY_POOL_CLASSES] = {
+      32,   48,   64,   96,   128,  192,  256,  384,  512,
+      768,  1024, 1536, 2048, 3072, 4096, 4608, 6144, 8192};
+
+  // Class of every block size rounded up to 16 bytes, all sizes above
+  // are multiples of 16
+  static constexpr auto classByGranule = []() {
+    std::array<int8_t, classSizes[MEMORY_POOL_CLASSES - 1] / 16 + 1> table{};
+    int c = 0;
+    for (size_t g = 0; g < table.size(); ++g) {
+      while (classSizes[c] < g * 16)
+        ++c;
+      table[g] = (int8_t)c;
+    }
+    return table;
+  }();
+
+  Shared_t shared[MEMORY_POOL_CLASSES];
+  std::atomic<long> inUse{0};
+  std::atomic<long> blocks{0};
+  std::atomic<size_t> peak{0};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> failures{0};
+  std::atomic<size_t> reserved{0};
+  std::atomic<size_t> limit{0};
+
+  // Set once the cache of this thread is destroyed, later releases during
+  // thread or process exit go straight to the shared lists
+  static inline thread_local bool cacheGone = false;
+
+  MemoryPool_t() = default;
+
+  static ThreadCache_t *threadCache() {
+    if (cacheGone)
+      return nullptr;
+    static thread_local ThreadCache_t cache;
+    return &cache;
+  }
+
+  static int classOf(size_t block) {
+#ifdef MEMORY_POOL_BYPASS
+    (void)block;
+    return -1;
+#else
+    if (block > classSizes[MEMORY_POOL_CLASSES - 1])
+      return -1;
+    return classByGranule[(block + 15) / 16];
+#endif
+  }
+
+  void count(ThreadCache_t *cache, long bytes, long blockCount,
+             uint64_t allocated) {
+    Counters_t direct;
+    Counters_t &c = cache ? cache->counters : direct;
+    c.bytes += bytes;
+    c.blocks += blockCount;
+    c.allocations += allocated;
+    if (cache == nullptr || c.bytes >= MEMORY_STATS_FLUSH ||
+        c.bytes <= -MEMORY_STATS_FLUSH)
+      publish(c);
+  }
+
+  void publish(Counters_t &c) {
+    long now =
+        inUse.fetch_add(c.bytes, std::memory_order_relaxed) + c.bytes;
+    blocks.fetch_add(c.blocks, std::memory_order_relaxed);
+    allocations.fetch_add(c.allocations, std::memory_order_relaxed);
+    c = Counters_t();
+
+    size_t seen = peak.load(std::memory_order_relaxed);
+    while (now > 0 && (size_t)now > seen &&
+           !peak.compare_exchange_weak(seen, (size_t)now,
+                                       std::memory_order_relaxed))
+      ;
+  }
+
+  void *take(int c, ThreadCache_t *cache) {
+    if (cache == nullptr) {
+      std::lock_guard<std::mutex> lock(shared[c].lock);
+      if (shared[c].head == nullptr)
+        grow(c);
+      FreeBlock_t *b = shared[c].head;
+      if (b != nullptr)
+        shared[c].head = b->next;
+      return b;
+    }
+
+    if (cache->head[c] == nullptr) {
+      std::lock_guard<std::mutex> lock(shared[c].lock);
+      for (int i = 0; i < MEMORY_POOL_BATCH; ++i) {
+        if (shared[c].head == nullptr && !grow(c))
+          break;
+        FreeBlock_t *b = shared[c].head;
+        shared[c].head = b->next;
+        b->next = cache->head[c];
+        cache->head[c] = b;
+        cache->count[c]++;
+      }
+    }
+    FreeBlock_t *b = cache->head[c];
+    if (b != nullptr) {
+      cache->head[c] = b->next;
+      cache->count[c]--;
+    }
+    return b;
+  }
+
+  void give(int c, FreeBlock_t *b, ThreadCache_t *cache) {
+    if (cache == nullptr) {
+      std::lock_guard<std::mutex> lock(shared[c].lock);
+      b->next = shared[c].head;
+      shared[c].head = b;
+      return;
+    }
+    b->next = cache->head[c];
+    cache->head[c] = b;
+    if (++cache->count[c] > 2 * MEMORY_POOL_BATCH)
+      flush(c, cache, MEMORY_POOL_BATCH);
+  }
+
+  // Moves up to n blocks of the thread cache to the shared list
+  void flush(int c, ThreadCache_t *cache, size_t n) {
+    std::lock_guard<std::mutex> lock(shared[c].lock);
+    for (size_t i = 0; i < n && cache->head[c] != nullptr; ++i) {
+      FreeBlock_t *b = cache->head[c];
+      cache->head[c] = b->next;
+      cache->count[c]--;
+      b->next = shared[c].head;
+      shared[c].head = b;
+    }
+  }
+
+  // Caller holds the lock of class c
+  bool grow(int c) {
+    size_t size = classSizes[c];
+    size_t count = std::max<size_t>(MEMORY_SLAB_SIZE / size, 8);
+    char *slab = (char *)malloc(size * count);
+    if (slab == nullptr)
+      return false;
+    reserved.fetch_add(size * count, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+      FreeBlock_t *b = (FreeBlock_t *)(slab + i * size);
+      b->next = shared[c].head;
+      shared[c].head = b;
+    }
+    return true;
+  }
+};
+
+// The process wide pool, never destroyed since threads and SQLite may
+// still release blocks while the process exits
+inline MemoryPool_t &memoryPool() {
+  static MemoryPool_t *pool = new MemoryPool_t();
+  return *pool;
+}
+
+// Pool block or std::bad_alloc, for wrapper types
+inline void *allocateBlock(size_t n) {
+  void *p = memoryPool().allocate(n);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+inline void releaseBlock(void *p) { memoryPool().release(p); }
+
+template <typename T> struct PoolAllocator_t {
+  typedef T value_type;
+
+  PoolAllocator_t() = default;
+  template <typename U> PoolAllocator_t(const PoolAllocator_t<U> &) {}
+
+  T *allocate(size_t n) { return (T *)allocateBlock(n * sizeof(T)); }
+  void deallocate(T *p, size_t) { releaseBlock(p); }
+
+  template <typename U> bool operator==(const PoolAllocator_t<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const PoolAllocator_t<U> &) const {
+    return false;
+  }
+};
+
+// Value initialized array in one pool block with its control block
+template <typename T> std::shared_ptr<T[]> makePooledArray(size_t n) {
+  return std::allocate_shared<T[]>(PoolAllocator_t<T>(), n);
+}
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,461 @@
+#ifndef SQL_PLAN_H
+#define SQL_PLAN_H
+
+#include "SQL_Schema.h"
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace SQL {
+
+// Distinct statements SQL_DB keeps scan reports for, the least sampled one
+// makes room for a new statement
+#define PLAN_MAX_SCAN_REPORTS (256)
+
+// Splits sql into identifiers (unquoted), a ' for each string literal and
+// single or double character operators, whitespace dropped
+inline std::vector<std::string> tokenizeSQL(const char *sql) {
+  std::vector<std::string> tokens;
+  const char *p = sql;
+  while (*p != '\0') {
+    if (isspace((unsigned char)*p)) {
+      ++p;
+    } else if (isalnum((unsigned char)*p) || *p == '_') {
+      const char *start = p;
+      while (isalnum((unsigned char)*p) || *p == '_')
+        ++p;
+      tokens.emplace_back(start, p);
+    } else if (*p == '"' || *p == '`' || *p == '[') {
+      char close = (*p == '[') ? ']' : *p;
+      const char *start = ++p;
+      while (*p != '\0' && *p != close)
+        ++p;
+      tokens.emplace_back(start, p);
+      if (*p != '\0')
+        ++p;
+    } else if (*p == '\'') {
+      ++p;
+      while (*p != '\0' && !(*p == '\'' && p[1] != '\''))
+        p += (*p == '\'') ? 2 : 1;
+      tokens.emplace_back("'");
+      if (*p != '\0')
+        ++p;
+    } else if (*p != '\0' && p[1] != '\0' && strchr("<>=!", *p) &&
+               strchr("<>=", p[1])) {
+      tokens.emplace_back(p, p + 2);
+      p += 2;
+    } else {
+      tokens.emplace_back(p, p + 1);
+      ++p;
+    }
+  }
+  return tokens;
+}
+
+// sql with its string and numeric literals replaced by ?, so statements
+// differing only in the values formatted into them share one key
+inline std::string normalizeSQL(const char *sql) {
+  std::string normalized;
+  for (const std::string &t : tokenizeSQL(sql)) {
+    if (!normalized.empty())
+      normalized += ' ';
+    if (t == "'" || isdigit((unsigned char)t[0]))
+      normalized += '?';
+    else
+      normalized += t;
+  }
+  return normalized;
+}
+
+// Plans name aliased tables by their alias ("SCAN r" for "FROM readings r"),
+// returns the identifier aliased as name in sql or name itself
+inline std::string aliasedTable(const char *sql, const std::string &name) {
+  std::vector<std::string> t = tokenizeSQL(sql);
+  for (size_t i = 2; i < t.size(); ++i) {
+    if (sqlite3_stricmp(t[i].c_str(), name.c_str()) != 0)
+      continue;
+    // "FROM table [AS] alias", "JOIN ..." or ", ..."
+    size_t k = (sqlite3_stricmp(t[i - 1].c_str(), "AS") == 0) ? i - 1 : i;
+    if (k < 2 || !isalpha((unsigned char)t[k - 1][0]))
+      continue;
+    const std::string &before = t[k - 2];
+    if (sqlite3_stricmp(before.c_str(), "FROM") == 0 ||
+        sqlite3_stricmp(before.c_str(), "JOIN") == 0 ||
+        sqlite3_stricmp(before.c_str(), "UPDATE") == 0 || before == "," ||
+        before == ".")
+      return t[k - 1];
+  }
+  return name;
+}
+
+// One line of EXPLAIN QUERY PLAN with the lines nested under it
+struct PlanNode_t {
+  int id = 0;
+  std::string detail; // "SCAN t", "SEARCH t USING INDEX i (a=?)", ...
+  std::vector<PlanNode_t> children;
+
+  // Full pass over a table or one of its indexes, virtual tables, constant
+  // rows and subqueries excluded
+  bool isScan() const {
+    return detail.size() > 5 && detail.compare(0, 5, "SCAN ") == 0 &&
+           detail[5] != '(' &&
+           detail.find("VIRTUAL TABLE") == std::string::npos &&
+           detail != "SCAN CONSTANT ROW";
+  }
+
+  // Table named by a SCAN or SEARCH line, "" for other lines
+  std::string table() const {
+    size_t start;
+    if (detail.compare(0, 5, "SCAN ") == 0)
+      start = 5;
+    else if (detail.compare(0, 7, "SEARCH ") == 0)
+      start = 7;
+    else
+      return "";
+    size_t end = detail.find(' ', start);
+    return detail.substr(start, end == std::string::npos ? end : end - start);
+  }
+};
+
+struct QueryPlan_t {
+  std::vector<PlanNode_t> nodes; // top level lines
+
+  // Tables read by a full scan anywhere in the plan
+  std::vector<std::string> scannedTables() const {
+    std::vector<std::string> tables;
+    visit(nodes, [&](const PlanNode_t &n) {
+      if (n.isScan())
+        tables.push_back(n.table());
+    });
+    return tables;
+  }
+
+  // Sorts in a temporary b-tree, an index could deliver the order
+  bool sortsWithTempBTree() const {
+    bool found = false;
+    visit(nodes, [&](const PlanNode_t &n) {
+      found |= n.detail.compare(0, 15, "USE TEMP B-TREE") == 0;
+    });
+    return found;
+  }
+
+  // Same layout as the sqlite3 shell's .eqp output
+  std::string toString() const {
+    std::string out = "QUERY PLAN\n";
+    print(nodes, "", out);
+    return out;
+  }
+
+private:
+  template <typename F>
+  static void visit(const std::vector<PlanNode_t> &nodes, F fn) {
+    for (const PlanNode_t &n : nodes) {
+      fn(n);
+      visit(n.children, fn);
+    }
+  }
+
+  static void print(const std::vector<PlanNode_t> &nodes,
+                    const std::string &prefix, std::string &out) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      bool last = i + 1 == nodes.size();
+      out += prefix + (last ? "`--" : "|--") + nodes[i].detail + "\n";
+      print(nodes[i].children, prefix + (last ? "   " : "|  "), out);
+    }
+  }
+};
+
+// A sampled statement that fully scanned a large table. Statements that
+// differ only in their literals share one report, see normalizeSQL.
+struct ScanReport_t {
+  std::string sql;    // the latest of those statements
+  std::string table;
+  long rows = 0;      // row count of table when last seen
+  size_t samples = 0; // times the statement was sampled doing the scan
+};
+
+struct IndexAdvice_t {
+  std::string table;
+  std::vector<std::string> columns; // index columns in order
+  size_t hits = 0;                  // observed statements it would serve
+  std::string example;              // one of those statements
+};
+
+// Collects the WHERE and ORDER BY shapes of single table statements and
+// turns them into index recommendations: equality columns first, then
+// either the ORDER BY columns or one range column, then the remaining
+// selected columns so the index covers the query. Columns are checked
+// against the schema when advising, not when observing.
+class IndexAdvisor_t {
+public:
+  // Maximum width of a covering index, wider ones keep only the key columns
+  static const size_t maxColumns = 6;
+
+  // false when sql is not a statement shape the advisor understands
+  bool observe(const char *sql) {
+    Shape_t shape;
+    if (!parse(sql, shape))
+      return false;
+
+    std::string key = shape.key();
+    auto it = shapes.find(key);
+    if (it == shapes.end())
+      it = shapes.emplace(key, Observed_t{shape, 0, sql}).first;
+    it->second.hits++;
+    return true;
+  }
+
+  // Recommendations not already served by an existing index, most hits
+  // first
+  std::vector<IndexAdvice_t> advise(const SchemaCatalog_t &schema) const {
+    std::vector<IndexAdvice_t> advice;
+    for (const auto &entry : shapes) {
+      const Observed_t &o = entry.second;
+      const TableInfo_t *table = schema.find(o.shape.table.c_str());
+      if (table == nullptr)
+        continue;
+
+      std::vector<std::string> columns = recommend(o.shape, *table);
+      if (columns.empty() || servedBy(*table, columns))
+        continue;
+
+      auto same = std::find_if(advice.begin(), advice.end(),
+                               [&](const IndexAdvice_t &a) {
+                                 return a.table == table->name &&
+                                        a.columns == columns;
+                               });
+      if (same != advice.end()) {
+        same->hits += o.hits;
+        continue;
+      }
+      advice.push_back({table->name, columns, o.hits, o.example});
+    }
+
+    std::sort(advice.begin(), advice.end(),
+              [](const IndexAdvice_t &a, const IndexAdvice_t &b) {
+                return a.hits > b.hits;
+              });
+    return advice;
+  }
+
+  void clear() { shapes.clear(); }
+
+private:
+  struct Shape_t {
+    std::string table;
+    std::vector<std::string> equality;
+    std::string range;
+    std::vector<std::string> order;
+    std::vector<std::string> selected; // empty unless a plain column list
+
+    std::string key() const {
+      std::string k = table + "|";
+      for (const std::string &c : equality)
+        k += c + ",";
+      k += "|" + range + "|";
+      for (const std::string &c : order)
+        k += c + ",";
+      k += "|";
+      for (const std::string &c : selected)
+        k += c + ",";
+      return k;
+    }
+  };
+
+  struct Observed_t {
+    Shape_t shape;
+    size_t hits;
+    std::string example;
+  };
+
+  std::unordered_map<std::string, Observed_t> shapes;
+
+  static std::vector<std::string>
+  recommend(const Shape_t &shape, const TableInfo_t &table) {
+    std::vector<std::string> columns;
+    auto add = [&](const std::string &name) {
+      const ColumnInfo_t *c = table.column(name.c_str());
+      if (c != nullptr &&
+          std::find(columns.begin(), columns.end(), c->name) == columns.end())
+        columns.push_back(c->name);
+    };
+
+    for (const std::string &c : shape.equality)
+      add(c);
+    if (!shape.order.empty() &&
+        (shape.range.empty() || sqlite3_stricmp(shape.range.c_str(),
+                                                shape.order[0].c_str()) == 0))
+      for (const std::string &c : shape.order)
+        add(c);
+    else if (!shape.range.empty())
+      add(shape.range);
+
+    if (columns.empty())
+      return columns;
+
+    size_t keyColumns = columns.size();
+    for (const std::string &c : shape.selected)
+      add(c);
+    if (columns.size() > maxColumns)
+      columns.resize(keyColumns);
+    return columns;
+  }
+
+  // An index or the INTEGER PRIMARY KEY already starts with columns
+  static bool servedBy(const TableInfo_t &table,
+                       const std::vector<std::string> &columns) {
+    std::vector<std::string> pk = table.primaryKey();
+    if (pk.size() == 1 &&
+        sqlite3_stricmp(pk[0].c_str(), columns[0].c_str()) == 0 &&
+        sqlite3_stricmp(table.column(pk[0].c_str())->declType.c_str(),
+                        "INTEGER") == 0)
+      return true;
+
+    for (const IndexInfo_t &index : table.indexes) {
+      if (index.columns.size() < columns.size())
+        continue;
+      bool prefix = true;
+      for (size_t i = 0; i < columns.size() && prefix; ++i)
+        prefix = sqlite3_stricmp(index.columns[i].c_str(),
+                                 columns[i].c_str()) == 0;
+      if (prefix)
+        return true;
+    }
+    return false;
+  }
+
+  static bool is(const std::string &token, const char *keyword) {
+    return sqlite3_stricmp(token.c_str(), keyword) == 0;
+  }
+
+  static bool isIdentifier(const std::string &token) {
+    return !token.empty() && (isalpha((unsigned char)token[0]) ||
+                              token[0] == '_');
+  }
+
+  // SELECT ... FROM t, UPDATE t ... WHERE and DELETE FROM t WHERE, joins
+  // and compound selects are not advised on
+  static bool parse(const char *sql, Shape_t &shape) {
+    std::vector<std::string> t = tokenizeSQL(sql);
+    size_t i = 0, n = t.size();
+    auto at = [&](size_t k) -> const std::string & {
+      static const std::string end;
+      return k < n ? t[k] : end;
+    };
+
+    if (is(at(0), "SELECT")) {
+      i = 1;
+      bool plain = true;
+      int depth = 0;
+      for (; i < n && !(depth == 0 && is(t[i], "FROM")); ++i) {
+        depth += (t[i] == "(") - (t[i] == ")");
+        if (depth == 0 && isIdentifier(t[i]) && at(i + 1) != "(" &&
+            !is(t[i], "DISTINCT") && !is(t[i], "AS"))
+          shape.selected.push_back(t[i]);
+        else if (t[i] != ",")
+          plain = false;
+      }
+      if (!plain)
+        shape.selected.clear();
+      ++i;
+    } else if (is(at(0), "DELETE") && is(at(1), "FROM")) {
+      i = 2;
+    } else if (is(at(0), "UPDATE")) {
+      i = 1;
+    } else {
+      return false;
+    }
+
+    if (!isIdentifier(at(i)))
+      return false;
+    shape.table = t[i++];
+    if (at(i) == ".") { // schema.table
+      shape.table = at(i + 1);
+      i += 2;
+    }
+    auto joins = [&](const std::string &token) {
+      return token == "," || is(token, "JOIN") || is(token, "NATURAL") ||
+             is(token, "LEFT") || is(token, "INNER") || is(token, "CROSS");
+    };
+    std::string alias;
+    if (is(at(i), "AS"))
+      ++i;
+    if (isIdentifier(at(i)) && !joins(t[i]) && !is(t[i], "WHERE") &&
+        !is(t[i], "ORDER") && !is(t[i], "GROUP") && !is(t[i], "LIMIT") &&
+        !is(t[i], "SET"))
+      alias = t[i++];
+    if (joins(at(i)))
+      return false;
+
+    // "alias.col" and "table.col" name the same column
+    auto column = [&](size_t &k) -> std::string {
+      if (at(k + 1) == "." &&
+          (is(t[k], shape.table.c_str()) ||
+           (!alias.empty() && is(t[k], alias.c_str())))) {
+        k += 2;
+        return at(k);
+      }
+      return t[k];
+    };
+
+    for (; i < n && !is(t[i], "WHERE") && !is(t[i], "ORDER"); ++i)
+      ;
+    if (is(at(i), "WHERE")) {
+      int depth = 0;
+      for (++i; i < n; ++i) {
+        depth += (t[i] == "(") - (t[i] == ")");
+        if (depth != 0)
+          continue;
+        if (is(t[i], "GROUP") || is(t[i], "ORDER") || is(t[i], "LIMIT") ||
+            is(t[i], "UNION") || is(t[i], "RETURNING"))
+          break;
+        if (is(t[i], "OR"))
+          return false;
+        if (!isIdentifier(t[i]) || at(i + 1) == "(")
+          continue;
+
+        size_t k = i;
+        std::string name = column(k);
+        const std::string &op = at(k + 1);
+        if (op == "=" || op == "==" || is(op, "IN") ||
+            (is(op, "IS") && !is(at(k + 2), "NOT")))
+          shape.equality.push_back(name);
+        else if ((op == "<" || op == ">" || op == "<=" || op == ">=" ||
+                  is(op, "BETWEEN")) &&
+                 shape.range.empty())
+          shape.range = name;
+        else
+          continue;
+        i = k + 1;
+        if (is(op, "BETWEEN")) // skip the AND of BETWEEN a AND b
+          for (; i < n && !is(t[i], "AND"); ++i)
+            ;
+      }
+    }
+
+    for (; i < n && !is(t[i], "ORDER"); ++i)
+      ;
+    if (is(at(i), "ORDER") && is(at(i + 1), "BY")) {
+      for (i += 2; i < n && isIdentifier(t[i]);) {
+        shape.order.push_back(column(i));
+        ++i;
+        if (is(at(i), "ASC") || is(at(i), "DESC"))
+          ++i;
+        if (at(i) != ",")
+          break;
+        ++i;
+      }
+    }
+
+    return !shape.equality.empty() || !shape.range.empty() ||
+           !shape.order.empty();
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -1,16 +1,21 @@
 #ifndef SQL_ROW
 #define SQL_ROW
 
+#include "SQL_Memory.h"
+#include "SQL_Shared.h"
 #include "SQL_Value.h"
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <memory>
 
 namespace SQL {
 struct Row_t {
   size_t colCount = 0;
-  SqlValue *values = nullptr;
   Row_t() = default;
   Row_t(size_t colCount) : colCount(colCount) {
-    this->values = new SqlValue[colCount];
+    buffer = makePooledArray<SqlValue>(colCount);
+    this->values = buffer.get();
   }
   ~Row_t() { destroy(); }
 
@@ -30,10 +35,32 @@ struct Row_t {
   void insertValue(SqlValue value, size_t cIdx) {
     if (cIdx >= colCount)
       return;
+    detach();
     if (values != nullptr)
-      values[cIdx] = value;
+      values[cIdx] = std::move(value);
   }
 
+  // Copies share their values until one of them changes, so the values
+  // are read through getValues() and written through editValues(), which
+  // detaches this row from its copies first
+  const SqlValue *getValues() const { return values; }
+  SqlValue *editValues() {
+    detach();
+    return values;
+  }
+
+  void detach() {
+    if (ownedAlone(buffer))
+      return;
+    std::shared_ptr<SqlValue[]> own = makePooledArray<SqlValue>(colCount);
+    for (size_t i = 0; i < colCount; ++i)
+      own[i] = values[i];
+    buffer = std::move(own);
+    values = buffer.get();
+  }
+
+  bool shared() const { return buffer.use_count() > 1; }
+
   const char *toSQLString() {
     size_t bufSize = (MAX_COLUMN_NAME_LENGTH + 1) * colCount + 1;
 
@@ -42,10 +69,12 @@ struct Row_t {
     const char *fmt_str = "%s,";
     const char *last_fmt_str = "%s";
 
-    for (size_t c = 0; c < colCount; ++c)
+    for (size_t c = 0; c < colCount; ++c) {
+      const char *text = values[c].toString();
       sprintf(buffer + (c * MAX_COLUMN_NAME_LENGTH),
-              (c == colCount - 1) ? fmt_str : last_fmt_str,
-              values[c].toString());
+              (c == colCount - 1) ? fmt_str : last_fmt_str, text);
+      free((void *)text);
+    }
 
     return buffer;
   }
@@ -56,45 +85,44 @@ struct Row_t {
     size_t pos = 0;
 
     for (size_t c = 0; c < colCount; ++c) {
-      size_t need =
-          snprintf(buffer + pos, bufSize - pos, "%s\t", values[c].toString());
+      const char *text = values[c].toString();
+      size_t need = snprintf(buffer + pos, bufSize - pos, "%s\t", text);
       if (need >= bufSize - pos) {
-        bufSize *= 2;
+        bufSize = std::max(bufSize * 2, pos + need + 1);
         buffer = (char *)realloc(buffer, bufSize);
-
-        need =
-            snprintf(buffer + pos, bufSize - pos, "%s\t", values[c].toString());
+        need = snprintf(buffer + pos, bufSize - pos, "%s\t", text);
       }
+      free((void *)text);
       pos += need;
     }
     return buffer;
   }
 
 private:
+  SqlValue *values = nullptr; // into buffer
+  std::shared_ptr<SqlValue[]> buffer;
+
   void destroy() {
-    if (values != nullptr) {
-      delete[] values;
-      values = nullptr;
-    }
+    buffer.reset();
+    values = nullptr;
     colCount = 0;
   }
 
+  // O(1), the values are shared until one side detaches
   void copy_from(const Row_t &o) {
     destroy();
     this->colCount = o.colCount;
-    this->values = new SqlValue[colCount];
-
-    for (size_t i = 0; i < colCount; ++i)
-      values[i] = o.values[i];
+    this->buffer = o.buffer;
+    this->values = o.values;
   }
 
   void move_from(Row_t &&o) noexcept {
     destroy();
     this->colCount = o.colCount;
-    this->values = new SqlValue[colCount];
-    for (size_t i = 0; i < colCount; ++i)
-      values[i] = std::move(o.values[i]);
-    o.destroy();
+    this->buffer = std::move(o.buffer);
+    this->values = o.values;
+    o.values = nullptr;
+    o.colCount = 0;
   }
 };
 } // namespace SQL
@@ -0,0 +1,169 @@
+#ifndef SQL_SCHEMA_H
+#define SQL_SCHEMA_H
+
+#include <cctype>
+#include <cstddef>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace SQL {
+
+struct ColumnInfo_t {
+  std::string name;
+  std::string declType;
+  bool notNull = false;
+  int pk = 0; // position in the primary key, 0 when not part of it
+};
+
+struct IndexInfo_t {
+  std::string name;
+  bool unique = false;
+  std::vector<std::string> columns;
+};
+
+struct TableInfo_t {
+  std::string name;
+  std::vector<ColumnInfo_t> columns;
+  std::vector<IndexInfo_t> indexes;
+
+  const ColumnInfo_t *column(const char *colName) const {
+    for (const ColumnInfo_t &c : columns)
+      if (sqlite3_stricmp(c.name.c_str(), colName) == 0)
+        return &c;
+    return nullptr;
+  }
+
+  std::vector<std::string> primaryKey() const {
+    std::vector<std::string> key;
+    for (int pos = 1;; ++pos) {
+      size_t before = key.size();
+      for (const ColumnInfo_t &c : columns)
+        if (c.pk == pos)
+          key.push_back(c.name);
+      if (key.size() == before)
+        return key;
+    }
+  }
+};
+
+// In-memory copy of the tables, columns and indexes of the main database.
+// The one statement run per lookup reads PRAGMA schema_version, the
+// catalog itself is only reloaded when that changes.
+class SchemaCatalog_t {
+public:
+  ~SchemaCatalog_t() { finalize(); }
+
+  // Must run before the connection closes
+  void finalize() {
+    sqlite3_finalize(versionStmt);
+    versionStmt = nullptr;
+  }
+
+  // Brings the catalog up to date, false when the schema could not be read,
+  // sqlite3_errcode(db) then tells why. A failed load is retried on the
+  // next refresh.
+  bool refresh(sqlite3 *db) {
+    if (versionStmt == nullptr &&
+        sqlite3_prepare_v3(db, "PRAGMA schema_version;", -1,
+                           SQLITE_PREPARE_PERSISTENT, &versionStmt,
+                           nullptr) != SQLITE_OK)
+      return false;
+
+    long current = -1;
+    if (sqlite3_step(versionStmt) == SQLITE_ROW)
+      current = sqlite3_column_int64(versionStmt, 0);
+    sqlite3_reset(versionStmt);
+    if (current < 0)
+      return false;
+    if (current == version)
+      return true;
+
+    if (!load(db))
+      return false;
+    version = current;
+    return true;
+  }
+
+  // Table names are case insensitive like in SQL
+  const TableInfo_t *find(const char *tableName) const {
+    auto it = tables.find(key(tableName));
+    return it == tables.end() ? nullptr : &it->second;
+  }
+
+private:
+  long version = -1;
+  sqlite3_stmt *versionStmt = nullptr;
+  std::unordered_map<std::string, TableInfo_t> tables;
+
+  static std::string key(const char *name) {
+    std::string k = name;
+    for (char &c : k)
+      c = (char)tolower((unsigned char)c);
+    return k;
+  }
+
+  bool load(sqlite3 *db) {
+    const char *columns_sql =
+        "SELECT m.name, p.name, p.type, p.\"notnull\", p.pk "
+        "FROM sqlite_master m JOIN pragma_table_info(m.name) p "
+        "WHERE m.type = 'table' ORDER BY m.name, p.cid;";
+    const char *indexes_sql =
+        "SELECT m.name, l.name, l.\"unique\", i.name "
+        "FROM sqlite_master m JOIN pragma_index_list(m.name) l "
+        "JOIN pragma_index_info(l.name) i "
+        "WHERE m.type = 'table' ORDER BY m.name, l.name, i.seqno;";
+
+    std::unordered_map<std::string, TableInfo_t> loaded;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, columns_sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *tableName = text(stmt, 0);
+      TableInfo_t &table = loaded[key(tableName)];
+      table.name = tableName;
+
+      ColumnInfo_t column;
+      column.name = text(stmt, 1);
+      column.declType = text(stmt, 2);
+      column.notNull = sqlite3_column_int(stmt, 3) != 0;
+      column.pk = sqlite3_column_int(stmt, 4);
+      table.columns.push_back(column);
+    }
+    if (sqlite3_finalize(stmt) != SQLITE_OK)
+      return false;
+
+    if (sqlite3_prepare_v2(db, indexes_sql, -1, &stmt, nullptr) != SQLITE_OK)
+      return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto it = loaded.find(key(text(stmt, 0)));
+      if (it == loaded.end())
+        continue;
+
+      std::vector<IndexInfo_t> &indexes = it->second.indexes;
+      const char *indexName = text(stmt, 1);
+      if (indexes.empty() || indexes.back().name != indexName) {
+        indexes.emplace_back();
+        indexes.back().name = indexName;
+        indexes.back().unique = sqlite3_column_int(stmt, 2) != 0;
+      }
+      indexes.back().columns.push_back(text(stmt, 3));
+    }
+    if (sqlite3_finalize(stmt) != SQLITE_OK)
+      return false;
+
+    tables = std::move(loaded);
+    return true;
+  }
+
+  static const char *text(sqlite3_stmt *stmt, int col) {
+    const char *p = (const char *)sqlite3_column_text(stmt, col);
+    return p ? p : "";
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SQL_SHARED_H
+#define SQL_SHARED_H
+
+#include <atomic>
+#include <memory>
+
+namespace SQL {
+
+// Copy-on-write test for buffers shared between copies of Row_t and
+// Matrix_t. With a single owner left, the fence orders our writes after
+// everything the released owners did with the buffer.
+template <typename T> bool ownedAlone(const std::shared_ptr<T> &buffer) {
+  if (buffer.use_count() > 1)
+    return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return true;
+}
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,419 @@
+#ifndef SQL_SNAPSHOT_H
+#define SQL_SNAPSHOT_H
+
+#include "SQL_Column.h"
+#include "SQL_Matrix.h"
+#include "SQL_Row.h"
+#include "SQL_Value.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace SQL {
+
+#define SNAPSHOT_MAGIC "SQLSNAP1"
+#define SNAPSHOT_VERSION 1
+
+// File layout, host byte order, every section 8 byte aligned:
+//   SnapshotHeader_t
+//   colCount column names of MAX_COLUMN_NAME_LENGTH bytes
+//   colCount SnapshotColumn_t
+//   per column: rowCount 8 byte Integer/Real slots, rowCount + 1 offsets
+//   into the column data, rowCount type bytes, then the Text (with its
+//   terminator) and Blob bytes
+struct SnapshotHeader_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t colCount;
+  uint64_t rowCount;
+  char name[MAX_TABLE_NAME_LENGTH];
+};
+
+struct SnapshotColumn_t {
+  uint64_t fixed;   // file offsets of the sections
+  uint64_t offsets;
+  uint64_t types;
+  uint64_t data;
+  uint64_t dataSize;
+};
+
+// Read-only matrix served straight from a memory mapped snapshot file.
+// Nothing is allocated on open, pages are read in by the kernel as rows are
+// touched and Text/Blob accessors point into the mapping. It is not a
+// Matrix_t: sortBy, hashJoin, hashGroupBy, registerMatrix and the rest take
+// one built by toMatrix(), which copies every value, so those consumers
+// get none of the savings of the mapping.
+class MatrixSnapshot_t {
+public:
+  size_t colCount = 0;
+  size_t rowCount = 0;
+
+  MatrixSnapshot_t() = default;
+  explicit MatrixSnapshot_t(const char *path) { open(path); }
+  ~MatrixSnapshot_t() { unmap(); }
+
+  MatrixSnapshot_t(const MatrixSnapshot_t &) = delete;
+  MatrixSnapshot_t &operator=(const MatrixSnapshot_t &) = delete;
+  MatrixSnapshot_t(MatrixSnapshot_t &&other) noexcept {
+    move_from(std::move(other));
+  }
+  MatrixSnapshot_t &operator=(MatrixSnapshot_t &&other) noexcept {
+    if (this != &other)
+      move_from(std::move(other));
+    return *this;
+  }
+
+  // Writes matrix to path through a temporary file, synced to disk before
+  // the rename, so neither a reader nor a crash sees a half written
+  // snapshot
+  static void save(const Matrix_t &matrix, const char *path) {
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE *f = fopen(tmpPath.c_str(), "wb");
+    if (f == nullptr)
+      throw std::runtime_error(std::string("Snapshot Error: cannot write ") +
+                               tmpPath);
+
+    const size_t cols = matrix.colCount, rows = matrix.rowCount;
+    SnapshotHeader_t header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.colCount = (uint32_t)cols;
+    header.rowCount = rows;
+    snprintf(header.name, sizeof(header.name), "%s", matrix.name);
+
+    std::vector<char> names(cols * MAX_COLUMN_NAME_LENGTH, '\0');
+    for (size_t c = 0; c < cols; ++c) {
+      const char *colName = matrix.getColumnName(c);
+      memcpy(&names[c * MAX_COLUMN_NAME_LENGTH], colName,
+             strnlen(colName, MAX_COLUMN_NAME_LENGTH - 1));
+    }
+
+    // Section offsets first, the directory precedes the data
+    std::vector<SnapshotColumn_t> columns(cols);
+    uint64_t pos = sizeof(header) + names.size() + cols * sizeof(columns[0]);
+    for (size_t c = 0; c < cols; ++c) {
+      SnapshotColumn_t &col = columns[c];
+      col.dataSize = 0;
+      for (size_t r = 0; r < rows; ++r)
+        col.dataSize += payloadSize(matrix.getValues()[r * cols + c]);
+
+      col.fixed = pos;
+      col.offsets = col.fixed + rows * 8;
+      col.types = col.offsets + (rows + 1) * 8;
+      col.data = col.types + align(rows);
+      pos = col.data + align(col.dataSize);
+    }
+
+    auto write = [f](const void *p, size_t n) {
+      return n == 0 || fwrite(p, 1, n, f) == n;
+    };
+    bool ok = write(&header, sizeof(header)) &&
+              write(names.data(), names.size()) &&
+              write(columns.data(), cols * sizeof(columns[0]));
+
+    std::vector<uint64_t> fixed(rows), offsets(rows + 1);
+    std::vector<uint8_t> types(align(rows), 0);
+    for (size_t c = 0; c < cols && ok; ++c) {
+      uint64_t dataPos = 0;
+      for (size_t r = 0; r < rows; ++r) {
+        const SqlValue &v = matrix.getValues()[r * cols + c];
+        types[r] = (uint8_t)v.type();
+        fixed[r] = 0;
+        if (v.type() == SqlValue::Integer) {
+          int64_t i = v.as_int();
+          memcpy(&fixed[r], &i, 8);
+        } else if (v.type() == SqlValue::Real) {
+          double d = v.as_real();
+          memcpy(&fixed[r], &d, 8);
+        }
+        offsets[r] = dataPos;
+        dataPos += payloadSize(v);
+      }
+      offsets[rows] = dataPos;
+
+      ok = write(fixed.data(), rows * 8) &&
+           write(offsets.data(), (rows + 1) * 8) &&
+           write(types.data(), types.size());
+      for (size_t r = 0; r < rows && ok; ++r) {
+        const SqlValue &v = matrix.getValues()[r * cols + c];
+        if (v.type() == SqlValue::Text)
+          ok = write(v.as_text(), v.bytes() + 1);
+        else if (v.type() == SqlValue::Blob)
+          ok = write(v.as_blob(), v.bytes());
+      }
+      static const char padding[8] = {};
+      ok = ok && write(padding, align(dataPos) - dataPos);
+    }
+
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path) != 0) {
+      remove(tmpPath.c_str());
+      throw std::runtime_error(std::string("Snapshot Error: cannot write ") +
+                               path);
+    }
+    syncDirectory(path);
+  }
+
+  // Maps path, throws when it is not a complete snapshot
+  void open(const char *path) {
+    unmap();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error(std::string("Snapshot Error: cannot open ") +
+                               path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(SnapshotHeader_t)) {
+      ::close(fd);
+      throw std::runtime_error(std::string("Snapshot Error: truncated ") +
+                               path);
+    }
+    mapSize = st.st_size;
+    void *p = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      mapSize = 0;
+      throw std::runtime_error(std::string("Snapshot Error: cannot map ") +
+                               path);
+    }
+    map = (const uint8_t *)p;
+
+    if (!validate()) {
+      unmap();
+      throw std::runtime_error(std::string("Snapshot Error: invalid ") +
+                               path);
+    }
+  }
+
+  const char *name() const { return header()->name; }
+
+  const char *getColumnName(size_t cIdx) const {
+    if (cIdx >= colCount)
+      return "";
+    return (const char *)map + sizeof(SnapshotHeader_t) +
+           cIdx * MAX_COLUMN_NAME_LENGTH;
+  }
+
+  long type(size_t rIdx, size_t cIdx) const {
+    return map[column(cIdx).types + rIdx];
+  }
+
+  // Same contract as the SqlValue accessors, the value has to be of the
+  // type asked for
+  long as_int(size_t rIdx, size_t cIdx) const {
+    int64_t i;
+    memcpy(&i, map + column(cIdx).fixed + rIdx * 8, 8);
+    return i;
+  }
+  double as_real(size_t rIdx, size_t cIdx) const {
+    double d;
+    memcpy(&d, map + column(cIdx).fixed + rIdx * 8, 8);
+    return d;
+  }
+  const char *as_text(size_t rIdx, size_t cIdx) const {
+    return (const char *)payload(rIdx, cIdx);
+  }
+  const uint8_t *as_blob(size_t rIdx, size_t cIdx) const {
+    return payload(rIdx, cIdx);
+  }
+
+  // Payload size of Text (without terminator) and Blob values
+  size_t bytes(size_t rIdx, size_t cIdx) const {
+    const uint64_t *offsets = offsetsOf(cIdx);
+    size_t n = offsets[rIdx + 1] - offsets[rIdx];
+    return (type(rIdx, cIdx) == SqlValue::Text && n > 0) ? n - 1 : n;
+  }
+
+  // Owned copies, for handing single values to code expecting SqlValue
+  SqlValue at(size_t rIdx, size_t cIdx) const {
+    switch (type(rIdx, cIdx)) {
+    case SqlValue::Integer:
+      return SqlValue(as_int(rIdx, cIdx));
+    case SqlValue::Real:
+      return SqlValue(as_real(rIdx, cIdx));
+    case SqlValue::Text:
+      return SqlValue(as_text(rIdx, cIdx), bytes(rIdx, cIdx));
+    case SqlValue::Blob:
+      return SqlValue((const void *)as_blob(rIdx, cIdx), bytes(rIdx, cIdx));
+    default:
+      return SqlValue();
+    }
+  }
+
+  Row_t getRow(size_t rIdx) const {
+    if (rIdx >= rowCount)
+      return Row_t();
+    Row_t r = Row_t(colCount);
+    SqlValue *cells = r.editValues();
+    for (size_t c = 0; c < colCount; ++c)
+      cells[c] = at(rIdx, c);
+    return r;
+  }
+
+  Column_t getColumn(size_t cIdx) const {
+    if (cIdx >= colCount)
+      return Column_t();
+    Column_t col = Column_t(rowCount);
+    for (size_t r = 0; r < rowCount; ++r)
+      col.values[r] = at(r, cIdx);
+    return col;
+  }
+
+  // Materializes the whole snapshot as a regular, writable matrix
+  Matrix_t toMatrix() const {
+    Matrix_t matrix = Matrix_t(colCount, rowCount);
+    snprintf(matrix.name, MAX_TABLE_NAME_LENGTH, "%s", name());
+    for (size_t c = 0; c < colCount; ++c)
+      matrix.setColumnName(getColumnName(c), c);
+    SqlValue *cells = matrix.editValues();
+    for (size_t r = 0; r < rowCount; ++r)
+      for (size_t c = 0; c < colCount; ++c)
+        cells[r * colCount + c] = at(r, c);
+    matrix.rowCount = rowCount;
+    return matrix;
+  }
+
+private:
+  const uint8_t *map = nullptr;
+  size_t mapSize = 0;
+
+  static uint64_t align(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+  // Makes the rename itself durable
+  static void syncDirectory(const char *path) {
+    std::string dir = path;
+    size_t slash = dir.find_last_of('/');
+    dir = (slash == std::string::npos) ? "." : dir.substr(0, slash + 1);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+      return;
+    fsync(fd);
+    ::close(fd);
+  }
+
+  static size_t payloadSize(const SqlValue &v) {
+    if (v.type() == SqlValue::Text)
+      return v.bytes() + 1;
+    if (v.type() == SqlValue::Blob)
+      return v.bytes();
+    return 0;
+  }
+
+  const SnapshotHeader_t *header() const {
+    return (const SnapshotHeader_t *)map;
+  }
+
+  const SnapshotColumn_t &column(size_t cIdx) const {
+    const SnapshotColumn_t *columns =
+        (const SnapshotColumn_t *)(map + sizeof(SnapshotHeader_t) +
+                                   colCount * MAX_COLUMN_NAME_LENGTH);
+    return columns[cIdx];
+  }
+
+  const uint64_t *offsetsOf(size_t cIdx) const {
+    return (const uint64_t *)(map + column(cIdx).offsets);
+  }
+
+  const uint8_t *payload(size_t rIdx, size_t cIdx) const {
+    return map + column(cIdx).data + offsetsOf(cIdx)[rIdx];
+  }
+
+  // Whether size bytes at offset lie inside the file, without wrapping
+  bool inside(uint64_t offset, uint64_t size) const {
+    return offset <= mapSize && size <= mapSize - offset;
+  }
+
+  // Checks the header, that every section lies inside the file and every
+  // row's type byte and offsets, so the accessors never leave the mapping.
+  // Reads the whole file once.
+  bool validate() {
+    const SnapshotHeader_t *h = header();
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != SNAPSHOT_VERSION ||
+        h->name[MAX_TABLE_NAME_LENGTH - 1] != '\0')
+      return false;
+
+    colCount = h->colCount;
+    rowCount = h->rowCount;
+    uint64_t directoryEnd = sizeof(SnapshotHeader_t) +
+                            colCount * MAX_COLUMN_NAME_LENGTH +
+                            colCount * sizeof(SnapshotColumn_t);
+    // rowCount bounded by the file size keeps rowCount * 8 from wrapping
+    if (directoryEnd > mapSize || rowCount > mapSize / 8)
+      return false;
+
+    for (size_t c = 0; c < colCount; ++c) {
+      if (getColumnName(c)[MAX_COLUMN_NAME_LENGTH - 1] != '\0')
+        return false;
+
+      const SnapshotColumn_t &col = column(c);
+      if (col.fixed % 8 != 0 || col.offsets % 8 != 0 ||
+          col.fixed < directoryEnd || !inside(col.fixed, rowCount * 8) ||
+          !inside(col.offsets, (rowCount + 1) * 8) ||
+          !inside(col.types, rowCount) || !inside(col.data, col.dataSize))
+        return false;
+
+      const uint64_t *offsets = offsetsOf(c);
+      const uint8_t *data = map + col.data;
+      if (offsets[0] != 0 || offsets[rowCount] != col.dataSize)
+        return false;
+      for (size_t r = 0; r < rowCount; ++r) {
+        uint64_t begin = offsets[r], end = offsets[r + 1];
+        if (begin > end || end > col.dataSize)
+          return false;
+        switch (map[col.types + r]) {
+        case SqlValue::Null:
+        case SqlValue::Integer:
+        case SqlValue::Real:
+          if (begin != end)
+            return false;
+          break;
+        case SqlValue::Text:
+          if (begin == end || data[end - 1] != '\0')
+            return false;
+          break;
+        case SqlValue::Blob:
+          break;
+        default:
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void unmap() {
+    if (map != nullptr)
+      munmap((void *)map, mapSize);
+    map = nullptr;
+    mapSize = 0;
+    colCount = 0;
+    rowCount = 0;
+  }
+
+  void move_from(MatrixSnapshot_t &&o) noexcept {
+    unmap();
+    map = o.map;
+    mapSize = o.mapSize;
+    colCount = o.colCount;
+    rowCount = o.rowCount;
+    o.map = nullptr;
+    o.mapSize = 0;
+    o.colCount = 0;
+    o.rowCount = 0;
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef SQL_SORT_H
+#define SQL_SORT_H
+
+#include "SQL_Value.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace SQL {
+
+// Below this many rows sorts stay on the calling thread
+#define PARALLEL_SORT_MIN_ROWS (16384)
+
+struct SortKey_t {
+  size_t col;
+  bool ascending = true;
+};
+
+// Orders rows of a row-major SqlValue array on a list of sort keys. Each key
+// column is decoded once up front so the comparisons do not chase SqlValue
+// payloads: Integer and Real columns compare as plain numbers, Text columns
+// on a normalized 8 byte prefix and only fall back to strcmp when the
+// prefixes tie. Columns mixing types use SqlValue::compare, which orders
+// by storage class first like SQLite.
+class RowComparator_t {
+public:
+  RowComparator_t(const SqlValue *values, size_t colCount, size_t rowCount,
+                  const SortKey_t *sortKeys, size_t keyCount)
+      : values(values), colCount(colCount) {
+    for (size_t k = 0; k < keyCount; ++k) {
+      if (sortKeys[k].col >= colCount)
+        continue;
+      keys.push_back(decode(sortKeys[k], rowCount));
+    }
+  }
+
+  // True when row a sorts before row b, ties go to the lower row index so
+  // the order is stable
+  bool operator()(size_t a, size_t b) const {
+    for (const Key &k : keys) {
+      int cmp = compare(k, a, b);
+      if (cmp != 0)
+        return k.ascending ? cmp < 0 : cmp > 0;
+    }
+    return a < b;
+  }
+
+private:
+  enum Kind { Integer = 0, Real = 1, Text = 2, Mixed = 3 };
+
+  struct Key {
+    Kind kind;
+    bool ascending;
+    size_t col;
+    std::vector<uint8_t> nulls;
+    std::vector<long> ints;
+    std::vector<double> reals;
+    std::vector<uint64_t> prefixes;
+  };
+
+  const SqlValue *values;
+  size_t colCount;
+  std::vector<Key> keys;
+
+  const SqlValue &at(size_t row, size_t col) const {
+    return values[row * colCount + col];
+  }
+
+  // First 8 bytes packed big-endian, compares like memcmp on the prefix
+  static uint64_t textPrefix(const char *s) {
+    uint64_t prefix = 0;
+    size_t i = 0;
+    for (; i < 8 && s[i] != '\0'; ++i)
+      prefix = (prefix << 8) | (uint8_t)s[i];
+    return prefix << (8 * (8 - i));
+  }
+
+  Key decode(const SortKey_t &sortKey, size_t rowCount) const {
+    Key k;
+    k.ascending = sortKey.ascending;
+    k.col = sortKey.col;
+
+    // Nulls are allowed in any typed column, any other mix is Mixed
+    long kind = SqlValue::Null;
+    for (size_t r = 0; r < rowCount; ++r) {
+      long t = at(r, k.col).type();
+      if (t == SqlValue::Null || t == kind)
+        continue;
+      if (kind != SqlValue::Null) {
+        kind = -1;
+        break;
+      }
+      kind = t;
+    }
+
+    switch (kind) {
+    case SqlValue::Null:
+    case SqlValue::Integer:
+      k.kind = Kind::Integer;
+      k.ints.resize(rowCount);
+      break;
+    case SqlValue::Real:
+      k.kind = Kind::Real;
+      k.reals.resize(rowCount);
+      break;
+    case SqlValue::Text:
+      k.kind = Kind::Text;
+      k.prefixes.resize(rowCount);
+      break;
+    default:
+      k.kind = Kind::Mixed;
+      return k;
+    }
+
+    k.nulls.resize(rowCount);
+    for (size_t r = 0; r < rowCount; ++r) {
+      const SqlValue &v = at(r, k.col);
+      if (v.type() == SqlValue::Null) {
+        k.nulls[r] = 1;
+        continue;
+      }
+      switch (k.kind) {
+      case Kind::Integer:
+        k.ints[r] = v.as_int();
+        break;
+      case Kind::Real:
+        k.reals[r] = v.as_real();
+        break;
+      case Kind::Text:
+        k.prefixes[r] = textPrefix(v.as_text());
+        break;
+      default:
+        break;
+      }
+    }
+    return k;
+  }
+
+  int compare(const Key &k, size_t a, size_t b) const {
+    if (k.kind == Kind::Mixed) {
+      return at(a, k.col).compare(at(b, k.col));
+    }
+
+    // Nulls sort first, same as SqlValue::operator<
+    if (k.nulls[a] || k.nulls[b])
+      return (int)k.nulls[b] - (int)k.nulls[a];
+
+    switch (k.kind) {
+    case Kind::Integer:
+      return (k.ints[a] > k.ints[b]) - (k.ints[a] < k.ints[b]);
+    case Kind::Real:
+      return (k.reals[a] > k.reals[b]) - (k.reals[a] < k.reals[b]);
+    case Kind::Text:
+      if (k.prefixes[a] != k.prefixes[b])
+        return k.prefixes[a] < k.prefixes[b] ? -1 : 1;
+      return strcmp(at(a, k.col).as_text(), at(b, k.col).as_text());
+    default:
+      return 0;
+    }
+  }
+};
+
+inline size_t sortThreadCount(size_t rowCount) {
+  size_t threads = std::thread::hardware_concurrency();
+  if (rowCount < PARALLEL_SORT_MIN_ROWS || threads < 2)
+    return 1;
+  return threads;
+}
+
+// Sorts the permutation index with one std::sort per thread over equal
+// chunks, then merges neighbouring chunks pairwise in parallel
+inline void parallelSort(std::vector<size_t> &index,
+                         const RowComparator_t &cmp) {
+  auto less = [&cmp](size_t a, size_t b) { return cmp(a, b); };
+  const size_t n = index.size();
+  const size_t threads = sortThreadCount(n);
+  if (threads == 1) {
+    std::sort(index.begin(), index.end(), less);
+    return;
+  }
+
+  size_t chunks = 1;
+  while (chunks * 2 <= threads)
+    chunks *= 2;
+
+  std::vector<size_t> bounds(chunks + 1);
+  for (size_t i = 0; i <= chunks; ++i)
+    bounds[i] = n * i / chunks;
+
+  auto begin = index.begin();
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < chunks; ++i)
+    workers.emplace_back([&, i]() {
+      std::sort(begin + bounds[i], begin + bounds[i + 1], less);
+    });
+  for (std::thread &t : workers)
+    t.join();
+
+  for (size_t width = 1; width < chunks; width *= 2) {
+    workers.clear();
+    for (size_t i = 0; i + width < chunks; i += 2 * width)
+      workers.emplace_back([&, i, width]() {
+        std::inplace_merge(begin + bounds[i], begin + bounds[i + width],
+                           begin + bounds[i + 2 * width], less);
+      });
+    for (std::thread &t : workers)
+      t.join();
+  }
+}
+
+// Indices of the first k rows in sorted order. Small inputs use a single
+// partial sort, large ones keep a bounded heap of k candidates per thread
+// and partial sort the survivors.
+inline std::vector<size_t> topKIndex(size_t rowCount, size_t k,
+                                     const RowComparator_t &cmp) {
+  auto less = [&cmp](size_t a, size_t b) { return cmp(a, b); };
+  k = std::min(k, rowCount);
+  if (k == 0)
+    return {};
+
+  const size_t threads = sortThreadCount(rowCount);
+  std::vector<size_t> candidates;
+
+  if (threads == 1 || k * threads >= rowCount) {
+    candidates.resize(rowCount);
+    std::iota(candidates.begin(), candidates.end(), 0);
+  } else {
+    std::vector<std::vector<size_t>> heaps(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t)
+      workers.emplace_back([&, t]() {
+        // Max-heap on the sort order, the root is the worst kept row
+        std::priority_queue<size_t, std::vector<size_t>, decltype(less)> heap(
+            less);
+        const size_t end = rowCount * (t + 1) / threads;
+        for (size_t r = rowCount * t / threads; r < end; ++r) {
+          if (heap.size() < k) {
+            heap.push(r);
+          } else if (less(r, heap.top())) {
+            heap.pop();
+            heap.push(r);
+          }
+        }
+        for (; !heap.empty(); heap.pop())
+          heaps[t].push_back(heap.top());
+      });
+    for (std::thread &t : workers)
+      t.join();
+
+    for (const std::vector<size_t> &h : heaps)
+      candidates.insert(candidates.end(), h.begin(), h.end());
+  }
+
+  std::partial_sort(candidates.begin(), candidates.begin() + k,
+                    candidates.end(), less);
+  candidates.resize(k);
+  return candidates;
+}
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef SQL_TIMESERIES_H
+#define SQL_TIMESERIES_H
+
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+namespace SQL {
+
+struct TimeSeriesPolicy_t {
+  long interval = 86400; // partition width, in units of the time column
+  long retention = 0; // partitions ending this long before the newest row
+                      // are dropped, 0 keeps everything
+  size_t hotPartitions = 2; // newest partitions keeping an insert prepared
+};
+
+// Rows of a time series live in one table per interval of the Integer time
+// column, named like "readings_p1700006400" after the first time it holds
+// ("_pm..." when negative). Every partition has an index on the time
+// column, so ingest only grows the newest one and expiring old data is a
+// DROP TABLE instead of a DELETE. SQL_DB keeps a view under the series
+// name over all partitions for plain queries.
+class TimeSeries_t {
+public:
+  std::string name;
+  std::string timeCol;
+  size_t timeIdx = 0;
+  std::vector<std::string> columns;
+  TimeSeriesPolicy_t policy;
+  std::map<long, std::string> partitions; // by first time, ascending
+  long newest = LONG_MIN; // latest time inserted
+
+  TimeSeries_t() = default;
+  // Owns prepared statements
+  TimeSeries_t(const TimeSeries_t &) = delete;
+  TimeSeries_t &operator=(const TimeSeries_t &) = delete;
+  ~TimeSeries_t() { finalize(); }
+
+  // Must run before the connection closes
+  void finalize() {
+    for (auto &hot : inserts)
+      sqlite3_finalize(hot.second);
+    inserts.clear();
+  }
+
+  // First time of the partition holding t
+  long partitionStart(long t) const {
+    long offset = t % policy.interval;
+    if (offset < 0)
+      offset += policy.interval;
+    return t - offset;
+  }
+
+  std::string partitionName(long start) const {
+    char suffix[32];
+    if (start < 0)
+      snprintf(suffix, sizeof(suffix), "_pm%lu", -(unsigned long)start);
+    else
+      snprintf(suffix, sizeof(suffix), "_p%ld", start);
+    return name + suffix;
+  }
+
+  // Inverse of partitionName, false for names of other tables
+  bool parsePartition(const char *table, long &start) const {
+    size_t prefix = name.size() + 2;
+    if (sqlite3_strnicmp(table, name.c_str(), name.size()) != 0 ||
+        sqlite3_strnicmp(table + name.size(), "_p", 2) != 0)
+      return false;
+
+    const char *digits = table + prefix + (table[prefix] == 'm');
+    if (*digits < '0' || *digits > '9')
+      return false;
+    char *end;
+    unsigned long value = strtoul(digits, &end, 10);
+    if (*end != '\0')
+      return false;
+    start = (digits != table + prefix) ? -(long)value : (long)value;
+    return partitionStart(start) == start;
+  }
+
+  // name as an SQL identifier, partitions, the view and the time column
+  // are always written quoted
+  static std::string quoted(const std::string &name) {
+    std::string q = "\"";
+    for (char c : name)
+      q += (c == '"') ? "\"\"" : std::string(1, c);
+    return q + "\"";
+  }
+
+  // Partitions with any time in [from, to)
+  std::vector<long> overlapping(long from, long to) const {
+    std::vector<long> starts;
+    if (from >= to)
+      return starts;
+    for (auto it = partitions.lower_bound(partitionStart(from));
+         it != partitions.end() && it->first < to; ++it)
+      starts.push_back(it->first);
+    return starts;
+  }
+
+  // Whether the partition at start ended retention before now
+  bool pastRetention(long start, long now) const {
+    if (policy.retention <= 0 || now < LONG_MIN + policy.retention)
+      return false;
+    return start + policy.interval <= now - policy.retention;
+  }
+
+  std::vector<long> expired(long now) const {
+    std::vector<long> starts;
+    for (auto &p : partitions)
+      if (pastRetention(p.first, now))
+        starts.push_back(p.first);
+    return starts;
+  }
+
+  // "SELECT * FROM p1 UNION ALL SELECT * FROM p2 ...", filtered on
+  // [from, to) when ranged. Without partitions a select of no rows keeps
+  // the column names.
+  std::string unionOf(const std::vector<long> &starts, bool ranged,
+                      long from = 0, long to = 0) const {
+    std::string sql;
+    std::string range = " WHERE " + quoted(timeCol) +
+                        " >= " + std::to_string(from) + " AND " +
+                        quoted(timeCol) + " < " + std::to_string(to);
+    for (long start : starts) {
+      sql += sql.empty() ? "SELECT * FROM " : " UNION ALL SELECT * FROM ";
+      sql += quoted(partitionName(start));
+      if (ranged)
+        sql += range;
+    }
+    if (!sql.empty())
+      return sql;
+
+    sql = "SELECT ";
+    for (size_t c = 0; c < columns.size(); ++c)
+      sql += (c == 0 ? "NULL AS " : ", NULL AS ") + quoted(columns[c]);
+    return sql + " WHERE 0";
+  }
+
+  std::vector<long> allPartitions() const {
+    std::vector<long> starts;
+    for (auto &p : partitions)
+      starts.push_back(p.first);
+    return starts;
+  }
+
+  // Cached insert of a partition, nullptr when it has to be prepared
+  sqlite3_stmt *hotInsert(long start) const {
+    auto it = inserts.find(start);
+    return it == inserts.end() ? nullptr : it->second;
+  }
+
+  // Caches stmt for start unless the partition is older than every hot
+  // one, in which case false is returned and the caller finalizes it
+  bool keepHot(long start, sqlite3_stmt *stmt) {
+    if (policy.hotPartitions == 0)
+      return false;
+    if (inserts.size() >= policy.hotPartitions) {
+      if (start < inserts.begin()->first)
+        return false;
+      sqlite3_finalize(inserts.begin()->second);
+      inserts.erase(inserts.begin());
+    }
+    inserts[start] = stmt;
+    return true;
+  }
+
+  void dropHot(long start) {
+    auto it = inserts.find(start);
+    if (it == inserts.end())
+      return;
+    sqlite3_finalize(it->second);
+    inserts.erase(it);
+  }
+
+private:
+  std::map<long, sqlite3_stmt *> inserts; // by partition start
+};
+
+} // namespace SQL
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef SQL_VTAB_H
+#define SQL_VTAB_H
+
+#include "SQL_Join.h"
+#include "SQL_Matrix.h"
+#include "SQL_Value.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace SQL {
+
+#define MATRIX_MODULE_NAME "wrapper_matrix"
+
+// A live Matrix_t exposed to SQL. Rows are read from the matrix on every
+// query, nothing is copied. With a key column, equality lookups on it go
+// through a hash index that picks up appended rows on its own; after the
+// rows are reordered or replaced call rebuildIndex. A dictionary encoded
+// key column is indexed by code.
+struct MatrixSource_t {
+  const Matrix_t *matrix;
+  long keyCol;
+  std::unordered_multimap<size_t, size_t> keyIndex; // hash -> row
+  size_t indexedRows = 0;
+  std::shared_ptr<const Dictionary_t> keyDict; // the index was built with
+
+  MatrixSource_t(const Matrix_t *matrix, long keyCol)
+      : matrix(matrix), keyCol(keyCol) {}
+
+  const SqlValue &at(size_t row, size_t col) const {
+    return matrix->getValues()[row * matrix->colCount + col];
+  }
+
+  void rebuildIndex() {
+    keyIndex.clear();
+    indexedRows = 0;
+    refreshIndex();
+  }
+
+  void refreshIndex() {
+    if (keyCol < 0 || (size_t)keyCol >= matrix->colCount)
+      return;
+    std::shared_ptr<const Dictionary_t> dict =
+        matrix->getColumnDictionary(keyCol);
+    if (matrix->rowCount < indexedRows || dict != keyDict) {
+      keyIndex.clear();
+      indexedRows = 0;
+      keyDict = std::move(dict);
+    }
+    for (size_t r = indexedRows; r < matrix->rowCount; ++r)
+      keyIndex.emplace(hashValue(at(r, keyCol), keyDict.get()), r);
+    indexedRows = matrix->rowCount;
+  }
+
+  // Rows whose key equals key under SQL comparison, so 2 also finds 2.0:
+  // hashValue hashes whole Reals as Integers and keyEquals matches them
+  void lookup(const SqlValue &key, std::vector<size_t> &rows) {
+    refreshIndex();
+    probe(key, rows);
+    std::sort(rows.begin(), rows.end());
+  }
+
+private:
+  void probe(const SqlValue &key, std::vector<size_t> &rows) {
+    uint32_t code = keyDict ? keyDict->codeOf(key) : NO_DICTIONARY_CODE;
+    auto range = keyIndex.equal_range(hashValue(key, keyDict.get()));
+    for (auto it = range.first; it != range.second; ++it) {
+      const SqlValue &v = at(it->second, keyCol);
+      if (code != NO_DICTIONARY_CODE ? keyDict->codeOf(v) == code
+                                     : keyEquals(v, key))
+        rows.push_back(it->second);
+    }
+  }
+};
+
+typedef std::unordered_map<std::string, MatrixSource_t> MatrixSources_t;
+
+// sqlite3_module callbacks, pAux of the module is the SQL_DB's
+// MatrixSources_t and the table name picks the source
+struct MatrixVTab_t {
+  sqlite3_vtab base;
+  MatrixSource_t *source;
+
+  struct Cursor_t {
+    sqlite3_vtab_cursor base;
+    MatrixSource_t *source;
+    bool keyed = false;
+    std::vector<size_t> rows;
+    size_t pos = 0;
+
+    size_t row() const { return keyed ? rows[pos] : pos; }
+    size_t count() const {
+      return keyed ? rows.size() : source->matrix->rowCount;
+    }
+  };
+
+  static int connect(sqlite3 *db, void *aux, int argc,
+                     const char *const *argv, sqlite3_vtab **vtab,
+                     char **err) {
+    MatrixSources_t *sources = (MatrixSources_t *)aux;
+    auto it = (argc > 2) ? sources->find(argv[2]) : sources->end();
+    if (it == sources->end()) {
+      *err = sqlite3_mprintf("No matrix registered as %s",
+                             argc > 2 ? argv[2] : "");
+      return SQLITE_ERROR;
+    }
+
+    const Matrix_t *matrix = it->second.matrix;
+    std::string schema = "CREATE TABLE x(";
+    for (size_t c = 0; c < matrix->colCount; ++c) {
+      char colName[MAX_COLUMN_NAME_LENGTH + 8];
+      if (matrix->getColumnName(c)[0] != '\0')
+        snprintf(colName, sizeof(colName), "\"%.*s\"",
+                 MAX_COLUMN_NAME_LENGTH - 1, matrix->getColumnName(c));
+      else
+        snprintf(colName, sizeof(colName), "c%zu", c);
+      schema += (c == 0) ? "" : ", ";
+      schema += colName;
+    }
+    schema += ");";
+
+    int rc = sqlite3_declare_vtab(db, schema.c_str());
+    if (rc != SQLITE_OK)
+      return rc;
+
+    MatrixVTab_t *table = new MatrixVTab_t();
+    table->source = &it->second;
+    *vtab = &table->base;
+    return SQLITE_OK;
+  }
+
+  static int disconnect(sqlite3_vtab *vtab) {
+    delete (MatrixVTab_t *)vtab;
+    return SQLITE_OK;
+  }
+
+  // idxNum 1 is an equality lookup on the key column, 0 a full scan
+  static int bestIndex(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    MatrixSource_t *source = ((MatrixVTab_t *)vtab)->source;
+    double rows = (double)source->matrix->rowCount;
+
+    info->idxNum = 0;
+    info->estimatedCost = rows;
+    info->estimatedRows = (sqlite3_int64)rows;
+
+    for (int i = 0; i < info->nConstraint; ++i) {
+      const auto &c = info->aConstraint[i];
+      if (!c.usable || c.op != SQLITE_INDEX_CONSTRAINT_EQ ||
+          c.iColumn != source->keyCol || source->keyCol < 0)
+        continue;
+
+      info->idxNum = 1;
+      info->aConstraintUsage[i].argvIndex = 1;
+      info->aConstraintUsage[i].omit = 1;
+      info->estimatedCost = 1 + std::log2(rows + 1);
+      info->estimatedRows = 1;
+      break;
+    }
+    return SQLITE_OK;
+  }
+
+  static int open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    Cursor_t *cur = new Cursor_t();
+    cur->source = ((MatrixVTab_t *)vtab)->source;
+    *cursor = &cur->base;
+    return SQLITE_OK;
+  }
+
+  static int close(sqlite3_vtab_cursor *cursor) {
+    delete (Cursor_t *)cursor;
+    return SQLITE_OK;
+  }
+
+  static int filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *,
+                    int argc, sqlite3_value **argv) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    cur->pos = 0;
+    cur->rows.clear();
+    cur->keyed = (idxNum == 1 && argc == 1);
+    if (cur->keyed)
+      cur->source->lookup(SqlValue::from_value(argv[0]), cur->rows);
+    return SQLITE_OK;
+  }
+
+  static int next(sqlite3_vtab_cursor *cursor) {
+    ((Cursor_t *)cursor)->pos++;
+    return SQLITE_OK;
+  }
+
+  static int eof(sqlite3_vtab_cursor *cursor) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    return cur->pos >= cur->count();
+  }
+
+  static int column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+                    int col) {
+    Cursor_t *cur = (Cursor_t *)cursor;
+    cur->source->at(cur->row(), col).result(ctx, SQLITE_STATIC);
+    return SQLITE_OK;
+  }
+
+  static int rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = (sqlite3_int64)((Cursor_t *)cursor)->row();
+    return SQLITE_OK;
+  }
+
+  static const sqlite3_module *module() {
+    static sqlite3_module m = [] {
+      sqlite3_module m = {};
+      m.iVersion = 1;
+      m.xCreate = connect;
+      m.xConnect = connect;
+      m.xBestIndex = bestIndex;
+      m.xDisconnect = disconnect;
+      m.xDestroy = disconnect;
+      m.xOpen = open;
+      m.xClose = close;
+      m.xFilter = filter;
+      m.xNext = next;
+      m.xEof = eof;
+      m.xColumn = column;
+      m.xRowid = rowid;
+      return m;
+    }();
+    return &m;
+  }
+};
+
+} // namespace SQL
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef SQL_VALUE_H
 #define SQL_VALUE_H
 
+#include <algorithm>
 #include <assert.h>
 #include <cstddef>
 #include <cstdint>
@@ -9,11 +10,17 @@
 #include <cstring>
 #include <sqlite3.h>
 #include <utility>
+#include <vector>
+
+#include "SQL_Codec.h"
+#include "SQL_Memory.h"
 
 namespace SQL {
 
 #define MAX_COLUMN_NAME_LENGTH (32)
 #define MAX_TABLE_NAME_LENGTH (32)
+// Dictionary code of a value that is not interned, see Dictionary_t
+#define NO_DICTIONARY_CODE (0xffffffffu)
 
 struct SqlValue {
   enum Type { Null = 0, Integer = 1, Real = 2, Text = 3, Blob = 4 };
@@ -31,11 +38,16 @@ struct SqlValue {
       return;
     }
     size = strlen(s);
-    st.s = new char[size];
-    strcpy(st.s, s);
+    st.s = (char *)allocateBlock(size + 1);
+    memcpy(st.s, s, size + 1);
+  }
+  SqlValue(const char *s, size_t n) : kind(Type::Text), size(n) {
+    st.s = (char *)allocateBlock(size + 1);
+    memcpy(st.s, s, size);
+    st.s[size] = '\0';
   }
   SqlValue(const void *data, size_t n) : kind(Type::Blob), size(n) {
-    st.b = new uint8_t[size];
+    st.b = (uint8_t *)allocateBlock(size);
     memcpy(st.b, data, size);
   }
 
@@ -78,7 +90,7 @@ struct SqlValue {
     case Real:
       return st.r == other.st.r;
     case Text:
-      return std::strcmp(st.s, other.st.s) == 0;
+      return st.s == other.st.s || std::strcmp(st.s, other.st.s) == 0;
     case Blob:
       return size == other.size && std::memcmp(st.b, other.st.b, size) == 0;
     }
@@ -87,40 +99,83 @@ struct SqlValue {
   }
   bool operator!=(const SqlValue &other) const { return !(*this == other); }
 
-  // Ordering (only for numeric values)
-  bool operator<(const SqlValue &other) const {
-    if (kind == Null)
-      return other.kind != Null;
-    if (other.kind == Null)
-      return false;
+  // Ordering like SQLite's ORDER BY: by storage class first, Null before
+  // Integer and Real before Text before Blob, then by value within the
+  // class. Integer and Real compare as numbers, Text and Blob bytewise.
+  // -1, 0 or 1.
+  int compare(const SqlValue &other) const {
+    int rank = storageRank(), otherRank = other.storageRank();
+    if (rank != otherRank)
+      return rank < otherRank ? -1 : 1;
+    if (rank == Null)
+      return 0;
 
-    if (kind == Integer && other.kind == Integer)
-      return st.i < other.st.i;
-    if (kind == Real && other.kind == Real)
-      return st.r < other.st.r;
-    if (kind == Integer && other.kind == Real)
-      return (double)st.i < other.st.r;
-    if (kind == Real && other.kind == Integer)
-      return st.r < (double)other.st.i;
-
-    if (kind == Text && other.kind == Text)
-      return strcmp(st.s, other.st.s) < 0;
-    if (kind == Blob && other.kind == Blob) {
-      const int cmp = memcmp(st.b, other.st.b, std::min(size, other.size));
-      return (cmp < 0) || (cmp == 0 && size < other.size);
+    switch (kind) {
+    case Integer:
+      if (other.kind == Integer)
+        return (st.i > other.st.i) - (st.i < other.st.i);
+      return -compareIntReal(other.st.r, st.i);
+    case Real:
+      if (other.kind == Integer)
+        return compareIntReal(st.r, other.st.i);
+      return (st.r > other.st.r) - (st.r < other.st.r);
+    case Text: {
+      int cmp = strcmp(st.s, other.st.s);
+      return (cmp > 0) - (cmp < 0);
+    }
+    case Blob: {
+      int cmp = memcmp(st.b, other.st.b, std::min(size, other.size));
+      if (cmp != 0)
+        return cmp < 0 ? -1 : 1;
+      return (size > other.size) - (size < other.size);
+    }
+    default:
+      return 0;
     }
-    return false;
   }
 
+  bool operator<(const SqlValue &other) const { return compare(other) < 0; }
+
   bool operator>(const SqlValue &other) const { return other < *this; }
 
   bool operator<=(const SqlValue &other) const { return !(other < *this); }
 
   bool operator>=(const SqlValue &other) const { return !(*this < other); }
 
-  long type() { return kind; }
+  long type() const { return kind; }
 
-  const char *typeString() {
+  // Text borrowed from a dictionary instead of owned, code is its index
+  // there. Copies own their text again, moves and share() keep borrowing.
+  static SqlValue interned(const char *s, size_t n, uint32_t code) {
+    SqlValue v;
+    v.kind = Type::Text;
+    v.size = n;
+    v.code = code;
+    v.st.s = (char *)s;
+    return v;
+  }
+
+  // NO_DICTIONARY_CODE unless the text is interned
+  uint32_t dictionaryCode() const { return code; }
+
+  // Copy that keeps interned text borrowed, only for holders that keep
+  // the dictionary of other alive, like copies of one matrix
+  void share(const SqlValue &other) {
+    if (other.code == NO_DICTIONARY_CODE) {
+      *this = other;
+      return;
+    }
+    destroy();
+    kind = other.kind;
+    size = other.size;
+    code = other.code;
+    st.s = other.st.s;
+  }
+
+  // Payload size in bytes for Text (without terminator) and Blob
+  size_t bytes() const { return size; }
+
+  const char *typeString() const {
     switch (kind) {
     case Type::Null:
       return "NULL\0";
@@ -137,7 +192,7 @@ struct SqlValue {
     }
   }
 
-  const char *toString() {
+  const char *toString() const {
     size_t bufSize = 32;
     char *buffer = (char *)malloc(bufSize);
 
@@ -162,18 +217,74 @@ struct SqlValue {
   }
 
   // Accessors (assert on wrong' type for simplicity)
-  long as_int() {
+  long as_int() const {
     assert(kind == Type::Integer);
     return st.i;
   }
-  double as_real() {
+  double as_real() const {
     assert(kind == Type::Real);
     return st.r;
   }
   const char *as_text() const { return (const char *)st.s; }
   const uint8_t *as_blob() const { return (uint8_t *)st.b; }
 
+  // Binds to parameter idx (1 based) of stmt. Text and Blob payloads are
+  // bound without a copy, so the value has to outlive the step. With a codec
+  // they are stored as a framed, compressed Blob instead.
+  int bind(sqlite3_stmt *stmt, int idx, const Codec_t *codec = nullptr) const {
+    switch (kind) {
+    case Type::Null:
+      return sqlite3_bind_null(stmt, idx);
+    case Type::Integer:
+      return sqlite3_bind_int64(stmt, idx, st.i);
+    case Type::Real:
+      return sqlite3_bind_double(stmt, idx, st.r);
+    case Type::Text:
+    case Type::Blob:
+      break;
+    }
+
+    if (codec == nullptr) {
+      if (kind == Type::Text)
+        return sqlite3_bind_text(stmt, idx, st.s, size, SQLITE_STATIC);
+      return sqlite3_bind_blob(stmt, idx, st.b, size, SQLITE_STATIC);
+    }
+
+    std::vector<uint8_t> frame;
+    writeCodecHeader(frame, (uint8_t)kind, size);
+    if (!codec->compress(st.b, size, frame))
+      return SQLITE_ERROR;
+    return sqlite3_bind_blob64(stmt, idx, frame.data(), frame.size(),
+                               SQLITE_TRANSIENT);
+  }
+
   // Helpers to create from sqlite3 column
+  static SqlValue from_column(sqlite3_stmt *stmt, int col,
+                              const Codec_t *codec) {
+    if (codec == nullptr || sqlite3_column_type(stmt, col) != SQLITE_BLOB)
+      return from_column(stmt, col);
+
+    const uint8_t *p = (const uint8_t *)sqlite3_column_blob(stmt, col);
+    size_t n = sqlite3_column_bytes(stmt, col);
+    uint8_t type;
+    uint64_t rawSize;
+    if (!readCodecHeader(p, n, *codec, type, rawSize) ||
+        (type != Type::Text && type != Type::Blob))
+      return from_column(stmt, col); // not a frame, keep the raw Blob
+
+    SqlValue v;
+    v.st.b = (uint8_t *)allocateBlock(rawSize + (type == Type::Text));
+    v.kind = (Type)type;
+    v.size = rawSize;
+    if (!codec->decompress(p + CODEC_HEADER_SIZE, n - CODEC_HEADER_SIZE,
+                           v.st.b, rawSize))
+      return from_column(stmt, col); // not ours, keep the raw Blob
+
+    if (v.kind == Type::Text)
+      v.st.s[rawSize] = '\0';
+    return v;
+  }
+
   static SqlValue from_column(sqlite3_stmt *stmt, int col) {
     int t = sqlite3_column_type(stmt, col);
     switch (t) {
@@ -184,7 +295,7 @@ struct SqlValue {
     case SQLITE_FLOAT:
       return SqlValue(sqlite3_column_double(stmt, col));
     case SQLITE_TEXT: {
-      const unsigned char *p = sqlite3_column_text(stmt, col);
+      const char *p = (const char *)sqlite3_column_text(stmt, col);
       int n = sqlite3_column_bytes(stmt, col);
       return SqlValue(p, n);
     }
@@ -198,15 +309,83 @@ struct SqlValue {
     }
   }
 
+  // Helpers to pass values in and out of user defined SQL functions
+  static SqlValue from_value(sqlite3_value *value) {
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_NULL:
+      return SqlValue{};
+    case SQLITE_INTEGER:
+      return SqlValue(static_cast<long>(sqlite3_value_int64(value)));
+    case SQLITE_FLOAT:
+      return SqlValue(sqlite3_value_double(value));
+    case SQLITE_TEXT: {
+      const char *p = (const char *)sqlite3_value_text(value);
+      int n = sqlite3_value_bytes(value);
+      return SqlValue(p, n);
+    }
+    case SQLITE_BLOB: {
+      const void *p = sqlite3_value_blob(value);
+      int n = sqlite3_value_bytes(value);
+      return SqlValue(p, n);
+    }
+    default:
+      return SqlValue{}; // defensive
+    }
+  }
+
+  // Text and Blob payloads are copied unless destructor is SQLITE_STATIC,
+  // which needs the value to outlive the statement step
+  void result(sqlite3_context *ctx,
+              sqlite3_destructor_type destructor = SQLITE_TRANSIENT) const {
+    switch (kind) {
+    case Type::Null:
+      sqlite3_result_null(ctx);
+      break;
+    case Type::Integer:
+      sqlite3_result_int64(ctx, st.i);
+      break;
+    case Type::Real:
+      sqlite3_result_double(ctx, st.r);
+      break;
+    case Type::Text:
+      sqlite3_result_text(ctx, st.s, size, destructor);
+      break;
+    case Type::Blob:
+      sqlite3_result_blob(ctx, st.b, size, destructor);
+      break;
+    }
+  }
+
 private:
+  // NaN ranks with Null, SQLite stores it as NULL
+  int storageRank() const {
+    if (kind == Real)
+      return (st.r != st.r) ? (int)Null : (int)Integer;
+    return (int)kind;
+  }
+
+  // Real r against Integer i without losing the low bits of i
+  static int compareIntReal(double r, long i) {
+    if (r < -9223372036854775808.0)
+      return -1;
+    if (r >= 9223372036854775808.0)
+      return 1;
+    long whole = (long)r;
+    if (whole != i)
+      return whole < i ? -1 : 1;
+    double s = (double)i;
+    return (r > s) - (r < s);
+  }
+
   Type kind;
-  size_t size; // in bytes
+  uint32_t code = NO_DICTIONARY_CODE; // fits the padding after kind
+  size_t size = 0;                    // in bytes
 
   union Storage {
     long i;
     double r;
-    char *s;    // non-trivial -> placement new + manual dtor
-    uint8_t *b; // non-trivial
+    char *s;    // pool block, see SQL_Memory.h
+    uint8_t *b; // pool block
     Storage() {}
     ~Storage() {}
   } st;
@@ -214,19 +393,20 @@ private:
   void destroy() {
     switch (kind) {
     case Type::Text:
-      delete[] st.s;
+      if (code == NO_DICTIONARY_CODE)
+        releaseBlock(st.s);
       break;
     case Type::Blob:
-      delete[] st.b;
+      releaseBlock(st.b);
       break;
     }
     kind = Type::Null;
+    code = NO_DICTIONARY_CODE;
     size = 0;
   }
 
+  // Stays Null when the allocation throws
   void copy_from(const SqlValue &o) {
-    size = o.size;
-    kind = o.kind;
     switch (o.kind) {
     case Type::Null:
       break;
@@ -237,14 +417,16 @@ private:
       st.r = o.st.r;
       break;
     case Type::Text:
-      st.s = new char[size];
-      strcpy(st.s, o.st.s);
+      st.s = (char *)allocateBlock(o.size + 1);
+      memcpy(st.s, o.st.s, o.size + 1);
       break;
     case Type::Blob:
-      st.b = new uint8_t[size];
-      memcpy((void *)&st.b, o.st.b, size);
+      st.b = (uint8_t *)allocateBlock(o.size);
+      memcpy(st.b, o.st.b, o.size);
       break;
     }
+    size = o.size;
+    kind = o.kind;
   }
 
   void move_from(SqlValue &&o) noexcept {
@@ -260,15 +442,17 @@ private:
       st.r = o.st.r;
       break;
     case Type::Text:
-      st.s = new char[size];
-      st.s = std::move(o.st.s);
+      st.s = o.st.s;
+      code = o.code;
       break;
     case Type::Blob:
-      st.b = new uint8_t[size];
-      st.b = std::move(o.st.b);
+      st.b = o.st.b;
       break;
     }
-    o.destroy();
+    // The payload now belongs to this value
+    o.kind = Type::Null;
+    o.code = NO_DICTIONARY_CODE;
+    o.size = 0;
   }
 };
 } // namespace SQL
@@ -1,13 +1,36 @@
 #ifndef SQL_DB_H
 #define SQL_DB_H
 
+#include "SQL_Array.h"
+#include "SQL_Busy.h"
+#include "SQL_CDC.h"
+#include "SQL_Dictionary.h"
+#include "SQL_Function.h"
+#include "SQL_Join.h"
 #include "SQL_Matrix.h"
+#include "SQL_Plan.h"
+#include "SQL_Schema.h"
+#include "SQL_Snapshot.h"
+#include "SQL_TimeSeries.h"
+#include "SQL_VTab.h"
 #include "SQL_Value.h"
 
+#include <algorithm>
+#include <climits>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifndef ARDUINO
 #include <stdexcept>
@@ -15,9 +38,28 @@
 
 namespace SQL {
 
+// Thrown for failed SQLite calls, code is the primary result code
+class SQL_Error_t : public std::runtime_error {
+public:
+  int code;
+  SQL_Error_t(const std::string &msg, int code)
+      : std::runtime_error(msg), code(code & 0xff) {}
+
+  // Another connection held the lock longer than the busy policy allows
+  bool busy() const { return code == SQLITE_BUSY || code == SQLITE_LOCKED; }
+};
+
+// Called after every backup step with the pages left to copy and the total
+// page count of the source database
+typedef std::function<void(int remaining, int pageCount)> BackupProgress_t;
+
 class SQL_DB {
 
 public:
+  // Disk serves straight from the file, Memory serves from an in-memory copy
+  // of the file that is written back through the backup API
+  enum Mode { Disk = 0, Memory = 1 };
+
   SQL_DB(const char *filename) : filename(filename) {
     if (sqlite3_open_v2(filename, &db,
                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
@@ -25,36 +67,103 @@ public:
       return;
 
     sql_err = nullptr;
+    busy.install(db);
+  }
+
+  // In Memory mode the file is loaded in bulk at startup and persisted every
+  // durabilityMs on a background thread, writes made inside that window are
+  // lost on a crash. A durabilityMs of 0 only persists on persist() and on
+  // destruction.
+  SQL_DB(const char *filename, Mode mode, unsigned int durabilityMs = 1000)
+      : filename(filename) {
+    if (mode == Mode::Disk) {
+      sqlite3_open_v2(filename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                      nullptr);
+      busy.install(db);
+      return;
+    }
+
+    // The persister shares the connection, so it has to be serialized. Both
+    // connections wait under the same busy policy as a Disk mode one.
+    const int flags =
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+    bool opened = sqlite3_open_v2(filename, &disk, flags, nullptr) ==
+                      SQLITE_OK &&
+                  sqlite3_open_v2(":memory:", &db, flags, nullptr) == SQLITE_OK;
+    if (opened) {
+      busy.install(disk);
+      busy.install(db);
+    }
+    if (!opened || copyDatabase(disk, db, -1, 0, nullptr) != SQLITE_DONE) {
+      std::string msg = db_error_msg("Load", disk);
+      sqlite3_close_v2(db);
+      sqlite3_close_v2(disk);
+      db = disk = nullptr;
+      throw std::runtime_error(msg);
+    }
+    persistedChanges = changeCounter();
+
+    if (durabilityMs > 0)
+      persister = std::thread([this, durabilityMs]() {
+        std::unique_lock<std::mutex> lock(persistLock);
+        while (!stopPersist) {
+          persistCv.wait_for(lock, std::chrono::milliseconds(durabilityMs));
+          if (!stopPersist)
+            persistLocked();
+        }
+      });
   }
 
   ~SQL_DB() {
+    if (disk != nullptr) {
+      {
+        std::lock_guard<std::mutex> lock(persistLock);
+        stopPersist = true;
+      }
+      persistCv.notify_all();
+      if (persister.joinable())
+        persister.join();
+
+      std::lock_guard<std::mutex> lock(persistLock);
+      persistLocked();
+      sqlite3_close_v2(disk);
+    }
+
+    for (auto &stmt : keyLookupStatements)
+      sqlite3_finalize(stmt.second);
+    for (auto &series : timeSeries)
+      series.second.finalize();
+    schema.finalize();
     sqlite3_close_v2(db);
     if (sql_err != nullptr)
       sqlite3_free(sql_err);
   }
 
-  inline bool tableExists(const char *tableName) {
-    // This bool and call back are used to check if the table exists in the db
-    bool exists = false;
-    auto callback = [](void *data, int argc, char **argv,
-                       char **colNames) -> int {
-      bool *exists_ptr = (bool *)(data);
-      *exists_ptr = (argc > 0 && argv[0] != nullptr);
-      return false;
-    };
-
-    const char *fmt_str =
-        "SELECT name FROM sqlite_master WHERE type='table' AND name='%s';";
+  // Writes the in-memory database back to its file, no-op in Disk mode or
+  // when nothing changed since the last persist. Inside a transaction it
+  // is deferred, the next persist after the commit writes the changes.
+  inline void persist() {
+    if (disk == nullptr)
+      return;
 
-    size_t need = snprintf(NULL, 0, fmt_str, tableName);
-    char *check = (char *)malloc(need);
-    sprintf(check, fmt_str, tableName);
+    std::lock_guard<std::mutex> lock(persistLock);
+    if (!persistLocked())
+      throw std::runtime_error(db_error_msg("Persist", disk));
+  }
 
-    // Execute the command and give it the callback
-    if (sqlite3_exec(db, check, callback, &exists, &sql_err) != SQLITE_OK)
-      return false;
+  // Answered from the schema catalog, no sqlite_master query unless the
+  // schema changed since the last lookup. Throws an SQL_Error_t when the
+  // schema cannot be read, e.g. while another connection holds a lock.
+  inline bool tableExists(const char *tableName) {
+    return tableInfo(tableName) != nullptr;
+  }
 
-    return exists;
+  // Columns, declared types, primary key and indexes of tableName, nullptr
+  // when it does not exist. Valid until the next schema change.
+  inline const TableInfo_t *tableInfo(const char *tableName) {
+    if (!schema.refresh(db))
+      throw SQL_Error_t(db_error_msg("Schema"), sqlite3_errcode(db));
+    return schema.find(tableName);
   }
 
   inline void createTable(Matrix_t matrix, unsigned short primaryKey) {
@@ -63,56 +172,82 @@ public:
     // example "value REAL NOT NULL);"
     const char *names_fmt_str = "%s %s %s%s";
 
+    for (size_t i = 0; i < matrix.colCount; ++i)
+      if (matrix.getColumnCodec(i))
+        setColumnCodec(matrix.name, matrix.getColumnName(i),
+                       matrix.getColumnCodec(i));
+
+    if (tableExists(matrix.name))
+      return;
+
     size_t nameBufSize = 64;
     char *nameBuffer = (char *)malloc(nameBufSize);
     size_t pos = 0;
 
     for (size_t i = 0; i < matrix.colCount; ++i) {
-      size_t need =
-          snprintf(nameBuffer + pos, nameBufSize - pos, names_fmt_str,
-                   matrix.getColumnName(i), matrix.values[i].typeString(),
-                   (i == primaryKey) ? "PRIMARY KEY" : "NOT NULL",
-                   (i == matrix.colCount - 1) ? ", " : "");
-      if (need > nameBufSize) {
+      // Compressed columns hold framed Blobs whatever the value type
+      const char *type = matrix.getColumnCodec(i)
+                             ? "BLOB"
+                             : matrix.getValues()[i].typeString();
+      const char *constraint = (i == primaryKey) ? "PRIMARY KEY" : "NOT NULL";
+      const char *separator = (i < matrix.colCount - 1) ? ", " : "";
+
+      size_t need = snprintf(NULL, 0, names_fmt_str, matrix.getColumnName(i),
+                             type, constraint, separator);
+      while (pos + need + 1 > nameBufSize) {
         nameBufSize *= 2;
         nameBuffer = (char *)realloc(nameBuffer, nameBufSize);
-        size_t need =
-            snprintf(nameBuffer + pos, nameBufSize - pos, names_fmt_str,
-                     matrix.getColumnName(i), matrix.values[i].typeString(),
-                     (i == primaryKey) ? "PRIMARY KEY" : "NOT NULL",
-                     (i < matrix.colCount - 1) ? ", " : "");
       }
-      pos += need;
+      pos += sprintf(nameBuffer + pos, names_fmt_str, matrix.getColumnName(i),
+                     type, constraint, separator);
     }
 
-    size_t need = snprintf(NULL, 0, fmt_str, matrix.name, nameBuffer);
+    size_t need = snprintf(NULL, 0, fmt_str, matrix.name, nameBuffer) + 1;
     char *buffer = (char *)malloc(need);
     sprintf(buffer, fmt_str, matrix.name, nameBuffer);
+    free(nameBuffer);
 
-    execSimpleSQL(buffer);
+    try {
+      execSimpleSQL(buffer);
+    } catch (const std::runtime_error &) {
+      free(buffer);
+      throw;
+    }
+    free(buffer);
   }
 
   inline void dropTable(const char *tableName) {
     const char *fmt_str = "DROP TABLE IF EXISTS %s;";
-    size_t bufSize = snprintf(NULL, 0, fmt_str, tableName);
+    size_t bufSize = snprintf(NULL, 0, fmt_str, tableName) + 1;
     char *buffer = (char *)malloc(bufSize);
     sprintf(buffer, fmt_str, tableName);
-    execSimpleSQL(buffer);
+    try {
+      execSimpleSQL(buffer);
+    } catch (const std::runtime_error &) {
+      free(buffer);
+      throw;
+    }
+    free(buffer);
   }
 
   inline void insertInto(Matrix_t matrix, Row_t data) {
     if (data.colCount != matrix.colCount)
       return;
 
-    const char *fmt_str = "INSERT INTO %s (%s) VALUES (%s);";
-    size_t bufSize = snprintf(
-        NULL, 0, fmt_str, matrix.getSQLColumnNamesString(), data.toSQLString());
-
-    char *sql_str = (char *)malloc(bufSize);
-    sprintf(sql_str, fmt_str, matrix.getSQLColumnNamesString(),
-            data.toSQLString());
+    auto series = timeSeries.find(matrix.name);
+    if (series != timeSeries.end()) {
+      transaction([&]() { insertIntoSeries(series->second, matrix, data); });
+      return;
+    }
 
-    execSimpleSQL(sql_str);
+    sqlite3_stmt *stmt = prepareInsert(matrix);
+    try {
+      bindAndStep(stmt, matrix, data);
+    } catch (const std::runtime_error &) {
+      sqlite3_finalize(stmt);
+      throw;
+    }
+    sqlite3_finalize(stmt);
   }
 
   inline void insertManySameTypeInto(Matrix_t matrix, Row_t *data,
@@ -121,98 +256,1073 @@ public:
     if (data->colCount != matrix.colCount)
       return;
 
-    short colCount = matrix.colCount;
-    sqlite3_stmt *stmt;
+    auto series = timeSeries.find(matrix.name);
+    if (series != timeSeries.end()) {
+      transaction([&]() {
+        for (unsigned long i = 0; i < rowCount; ++i)
+          insertIntoSeries(series->second, matrix, data[i]);
+      });
+      return;
+    }
 
-    execSimpleSQL(strdup("BEGIN TRANSACTION;"));
+    // One statement for every row, only the bindings change
+    sqlite3_stmt *stmt = prepareInsert(matrix);
 
-    const char *fmt_str = "INSERT INTO %s (%s) VALUES (%s);";
+    try {
+      transaction([&]() {
+        for (unsigned long i = 0; i < rowCount; ++i)
+          bindAndStep(stmt, matrix, data[i]);
+      });
+    } catch (const std::runtime_error &) {
+      sqlite3_finalize(stmt);
+      throw;
+    }
+    sqlite3_finalize(stmt);
+  }
 
-    for (unsigned long i = 0; i < rowCount; ++i) {
-      size_t bufSize =
-          snprintf(NULL, 0, fmt_str, matrix.getSQLColumnNamesString(),
-                   data.toSQLString());
+  inline Matrix_t selectFromTable(const char *tableName) {
+    size_t bufSize = snprintf(NULL, 0, "SELECT * FROM %s;", tableName) + 1;
+    char *sql_str = (char *)malloc(bufSize);
+    sprintf(sql_str, "SELECT * FROM %s;", tableName);
 
-      char *sql_str = (char *)malloc(bufSize);
-      sprintf(sql_str, fmt_str, matrix.getSQLColumnNamesString(),
-              data.toSQLString());
+    Matrix_t matrix;
+    try {
+      matrix = queryToTable(sql_str, tableName);
+    } catch (const std::runtime_error &) {
+      free(sql_str);
+      throw;
+    }
+    free(sql_str);
+    return matrix;
+  }
+
+  // Runs body in a transaction and commits it. Write transactions start
+  // with BEGIN IMMEDIATE so the write lock is taken up front instead of
+  // failing on a read to write upgrade. A lock wait inside gives up after
+  // the busy policy lockTimeoutMs, then the whole body is rolled back and
+  // run again with backoff until timeoutMs passes. Nested calls join the
+  // outer transaction. After a rollback the time series re-read their
+  // partitions before they are used again.
+  template <typename F> inline void transaction(F body, bool write = true) {
+    if (sqlite3_get_autocommit(db) == 0) {
+      body();
+      return;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(busy.policy.timeoutMs);
+    struct Retrying_t {
+      BusyScheduler_t &busy;
+      ~Retrying_t() { busy.stopRetrying(); }
+    } retrying{busy};
+    busy.retryUntil(deadline);
+
+    for (int attempt = 0;; ++attempt) {
+      try {
+        execSimpleSQL(write ? "BEGIN IMMEDIATE;" : "BEGIN;");
+        body();
+        execSimpleSQL("COMMIT;");
+        return;
+      } catch (const SQL_Error_t &e) {
+        if (sqlite3_get_autocommit(db) == 0)
+          sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        seriesStale = !timeSeries.empty();
+        if (!e.busy() || std::chrono::steady_clock::now() >= deadline)
+          throw;
+      } catch (...) {
+        if (sqlite3_get_autocommit(db) == 0)
+          sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        seriesStale = !timeSeries.empty();
+        throw;
+      }
+      busy.countRetry();
+      busy.sleep(busy.backoffUs(attempt));
+    }
+  }
 
-      if (sqlite3_prepare_v2(db, sql_str, -1, &stmt, nullptr) != SQLITE_OK)
-        throw std::runtime_error(db_error_msg("Prepare"));
+  inline void setBusyPolicy(BusyPolicy_t policy) { busy.policy = policy; }
 
-      if (sqlite3_step(stmt) != SQLITE_DONE)
-        throw std::runtime_error(db_error_msg("Step"));
+  inline BusyStats_t busyStats() const { return busy.stats(); }
 
-      sqlite3_reset(stmt);
+  // Runs any statement and returns its rows, the way to call registered
+  // functions: query("SELECT half(value) FROM test WHERE half(value) > 1;")
+  // Compressed columns come back as their framed Blobs, query() does not
+  // know which table a column is from. Define SQLITE_ENABLE_COLUMN_METADATA
+  // (libsqlite3 has to be built with it) to decode columns taken straight
+  // from a table, or use selectFromTable/selectByKeys.
+  inline Matrix_t query(const char *sql) { return queryToTable(sql); }
 
-      sqlite3_finalize(stmt);
+  // Same as query with an array bound to the first parameter, used as
+  // "... WHERE id IN wrapper_array(?1)"
+  inline Matrix_t query(const char *sql, const ArrayParam_t &array) {
+    ensureArrayModule();
+    return queryToTable(sql, nullptr, &array);
+  }
+
+  // Multi-get: every row of tableName whose keyCol is in keys, in a single
+  // execution of a cached statement instead of one query per key
+  inline Matrix_t selectByKeys(const char *tableName, const char *keyCol,
+                               const ArrayParam_t &keys) {
+    const TableInfo_t *table = tableInfo(tableName);
+    if (table == nullptr || table->column(keyCol) == nullptr)
+      throw std::runtime_error(
+          std::string("Schema Error: no such column: ") + tableName + "." +
+          keyCol);
+
+    ensureArrayModule();
+    sqlite3_stmt *stmt = keyLookupStatement(tableName, keyCol);
+    if (keys.bind(stmt, 1) != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Bind"), sqlite3_errcode(db));
+
+    Matrix_t selection = stmtToTable(stmt, tableName);
+    sqlite3_clear_bindings(stmt);
+    return selection;
+  }
+  inline Matrix_t selectByKeys(const char *tableName, const char *keyCol,
+                               std::span<const int64_t> keys) {
+    return selectByKeys(tableName, keyCol, ArrayParam_t(keys));
+  }
+  inline Matrix_t selectByKeys(const char *tableName, const char *keyCol,
+                               std::span<const std::string> keys) {
+    return selectByKeys(tableName, keyCol, ArrayParam_t(keys));
+  }
+  inline Matrix_t selectByKeys(const char *tableName, const char *keyCol,
+                               const Column_t &keys) {
+    return selectByKeys(tableName, keyCol, ArrayParam_t(keys));
+  }
+
+  // Values of tableName.colName go through codec when inserted and selected.
+  // createTable registers the codecs of its matrix, other tables or a fresh
+  // SQL_DB on an existing file need this call. nullptr removes the codec.
+  inline void setColumnCodec(const char *tableName, const char *colName,
+                             std::shared_ptr<const Codec_t> codec) {
+    std::string key = std::string(tableName) + "." + colName;
+    if (codec)
+      columnCodecs[key] = std::move(codec);
+    else
+      columnCodecs.erase(key);
+  }
+
+  // Text columns of query results are interned into one dictionary per
+  // column: each distinct string is held once, cells borrow it and
+  // hashJoin, hashGroupBy and matrix key lookups compare codes. A column
+  // stops adding strings after maxDistinct, later new strings are stored
+  // as usual. 0 turns it off, columns with a codec are never interned.
+  inline void setDictionaryEncoding(size_t maxDistinct) {
+    dictionaryLimit = maxDistinct;
+  }
+
+  // Makes fn callable from SQL as name(...), argCount -1 takes any number of
+  // arguments. Deterministic functions may be used in indexes and WHERE
+  // clauses the planner can optimize, only pass false if fn has side
+  // effects or depends on anything but its arguments.
+  inline void registerFunction(const char *name, int argCount,
+                               ScalarFunction_t fn, bool deterministic = true) {
+    createFunction(name, argCount, deterministic, new ScalarHolder_t(fn));
+  }
+
+  // Typed variant, the argument count and conversions come from the
+  // callable: registerTypedFunction("half", [](double x) { return x / 2; })
+  template <typename F>
+  inline void registerTypedFunction(const char *name, F fn,
+                                    bool deterministic = true) {
+    typedef typename TypedHolderFor_t<decltype(std::function(fn))>::type
+        Holder_t;
+    createFunction(name, Holder_t::argCount, deterministic, new Holder_t(fn));
+  }
+
+  // Aggregate keeping a State per group, step folds each row in and final
+  // turns the state into the result:
+  //   registerAggregate<double>("real_sum", 1,
+  //       [](double &s, int, const SqlValue *v) { s += v[0].as_real(); },
+  //       [](double &s) { return SqlValue(s); });
+  template <typename State>
+  inline void registerAggregate(
+      const char *name, int argCount,
+      std::function<void(State &, int argc, const SqlValue *argv)> step,
+      std::function<SqlValue(State &)> final, bool deterministic = true) {
+    typedef AggregateHolder_t<State> Holder_t;
+    Holder_t *holder = new Holder_t{step, final};
+    if (sqlite3_create_function_v2(
+            db, name, argCount, functionFlags(deterministic), holder, nullptr,
+            Holder_t::xStep, Holder_t::xFinal, Holder_t::destroy) != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Create Aggregate"), sqlite3_errcode(db));
+  }
+
+  // Exposes matrix to SQL as the temp virtual table name without copying
+  // it, so it can be scanned and joined like any table. The matrix has to
+  // outlive the registration. keyCol >= 0 indexes that column for equality
+  // lookups and joins.
+  inline void registerMatrix(const char *name, const Matrix_t &matrix,
+                             long keyCol = -1) {
+    if (!matrixModule) {
+      if (sqlite3_create_module_v2(db, MATRIX_MODULE_NAME,
+                                   MatrixVTab_t::module(), &matrixSources,
+                                   nullptr) != SQLITE_OK)
+        throw SQL_Error_t(db_error_msg("Create Module"), sqlite3_errcode(db));
+      matrixModule = true;
     }
 
-    execSimpleSQL(strdup("COMMIT;"));
+    unregisterMatrix(name);
+    matrixSources.emplace(name, MatrixSource_t(&matrix, keyCol));
+
+    const char *fmt_str = "CREATE VIRTUAL TABLE temp.%s USING %s;";
+    size_t bufSize = snprintf(NULL, 0, fmt_str, name, MATRIX_MODULE_NAME) + 1;
+    char *buffer = (char *)malloc(bufSize);
+    sprintf(buffer, fmt_str, name, MATRIX_MODULE_NAME);
+    try {
+      execSimpleSQL(buffer);
+    } catch (const std::runtime_error &) {
+      free(buffer);
+      matrixSources.erase(name);
+      throw;
+    }
+    free(buffer);
   }
 
-  inline Matrix_t selectFromTable(const char *tableName) {
-    Matrix_t matrix;
+  inline void unregisterMatrix(const char *name) {
+    if (matrixSources.find(name) == matrixSources.end())
+      return;
 
-    size_t bufSize = snprintf(NULL, 0, "SELECT * FROM %s;", tableName);
-    char *sql_str = (char *)malloc(bufSize);
-    sprintf(sql_str, "SELECT * FROM %s", tableName);
+    const char *fmt_str = "DROP TABLE IF EXISTS temp.%s;";
+    size_t bufSize = snprintf(NULL, 0, fmt_str, name) + 1;
+    char *buffer = (char *)malloc(bufSize);
+    sprintf(buffer, fmt_str, name);
+    try {
+      execSimpleSQL(buffer);
+    } catch (const std::runtime_error &) {
+      free(buffer);
+      throw;
+    }
+    free(buffer);
+    matrixSources.erase(name);
+  }
+
+  // Call after the rows of a registered matrix were reordered or replaced,
+  // appends are picked up without it
+  inline void rebuildMatrixIndex(const char *name) {
+    auto it = matrixSources.find(name);
+    if (it != matrixSources.end())
+      it->second.rebuildIndex();
+  }
+
+  // Publishes every committed insert, update and delete on this connection
+  // into a new stream of the given capacity. Consumers on any thread read
+  // it with tryPop, writers never wait for them.
+  inline std::shared_ptr<ChangeStream_t>
+  captureChanges(size_t capacity = 4096) {
+    std::shared_ptr<ChangeStream_t> stream =
+        std::make_shared<ChangeStream_t>(capacity);
+    captureChanges(stream);
+    return stream;
+  }
+
+  // Publishes into an existing stream, several connections may share one
+  inline void captureChanges(std::shared_ptr<ChangeStream_t> stream) {
+    capture.uninstall(db);
+    capture.install(db, std::move(stream));
+  }
+
+  inline void stopCapture() { capture.uninstall(db); }
+
+  // Makes matrix.name a time series partitioned on the Integer column
+  // timeCol, see TimeSeries_t. From then on insertInto and
+  // insertManySameTypeInto route its rows into their partitions, creating
+  // them on first use and dropping the ones past retention. Partitions of
+  // an earlier run are picked up again; the policy is not stored, pass it
+  // each time the database is opened.
+  inline void createTimeSeries(Matrix_t matrix, const char *timeCol,
+                               TimeSeriesPolicy_t policy = {}) {
+    size_t timeIdx = 0;
+    while (timeIdx < matrix.colCount &&
+           strcmp(matrix.getColumnName(timeIdx), timeCol) != 0)
+      ++timeIdx;
+    if (timeIdx == matrix.colCount)
+      throw std::runtime_error(
+          std::string("TimeSeries Error: no such column: ") + matrix.name +
+          "." + timeCol);
+    if (policy.interval <= 0)
+      throw std::runtime_error("TimeSeries Error: interval must be positive");
+    if (tableExists(matrix.name))
+      throw std::runtime_error(std::string("TimeSeries Error: ") +
+                               matrix.name + " is a table");
+
+    TimeSeries_t &series = timeSeries[matrix.name];
+    series.finalize();
+    series.name = matrix.name;
+    series.timeCol = timeCol;
+    series.timeIdx = timeIdx;
+    series.policy = policy;
+    series.columns.clear();
+    for (size_t c = 0; c < matrix.colCount; ++c) {
+      series.columns.push_back(matrix.getColumnName(c));
+      if (matrix.getColumnCodec(c))
+        setColumnCodec(matrix.name, matrix.getColumnName(c),
+                       matrix.getColumnCodec(c));
+    }
+
+    loadPartitions(series);
+    refreshSeriesView(series);
+  }
+
+  // Runs sql with the series name standing for the rows whose time is in
+  // [from, to). Only the partitions overlapping the range are read, through
+  // a common table expression that shadows the view:
+  //   queryTimeSeries("readings", t0, t1,
+  //                   "SELECT sensor, avg(value) FROM readings GROUP BY 1;")
+  inline Matrix_t queryTimeSeries(const char *name, long from, long to,
+                                  const char *sql) {
+    const TimeSeries_t &series = findSeries(name);
+    std::string cte = series.name + " AS (" +
+                      series.unionOf(series.overlapping(from, to), true, from,
+                                     to) +
+                      ")";
+
+    // Joins a WITH clause of sql
+    const char *rest = sql;
+    while (isspace((unsigned char)*rest))
+      ++rest;
+    std::string with = "WITH ";
+    if (sqlite3_strnicmp(rest, "WITH", 4) == 0 &&
+        isspace((unsigned char)rest[4])) {
+      rest += 5;
+      while (isspace((unsigned char)*rest))
+        ++rest;
+      if (sqlite3_strnicmp(rest, "RECURSIVE", 9) == 0 &&
+          isspace((unsigned char)rest[9])) {
+        with += "RECURSIVE ";
+        rest += 10;
+      }
+      cte += ",";
+    }
+    std::string rewritten = with + cte + " " + rest;
+    return queryToTable(rewritten.c_str(), name);
+  }
+
+  // Drops the partitions that ended retention before now, returns how
+  // many. Inserts call it whenever they open a new partition.
+  inline size_t expireTimeSeries(const char *name, long now) {
+    TimeSeries_t &series = findSeries(name);
+    std::vector<long> starts = series.expired(now);
+    if (starts.empty())
+      return 0;
+
+    transaction([&]() {
+      for (long start : starts) {
+        series.dropHot(start);
+        dropPartition(series, start);
+      }
+      for (long start : starts)
+        series.partitions.erase(start);
+      refreshSeriesView(series);
+    });
+    return starts.size();
+  }
+
+  // Drops the view and every partition
+  inline void dropTimeSeries(const char *name) {
+    TimeSeries_t &series = findSeries(name);
+    series.finalize();
+    transaction([&]() {
+      for (auto &p : series.partitions)
+        dropPartition(series, p.first);
+      std::string dropView =
+          "DROP VIEW IF EXISTS " + TimeSeries_t::quoted(series.name) + ";";
+      execSimpleSQL(dropView.c_str());
+    });
+    timeSeries.erase(series.name);
+  }
+
+  // EXPLAIN QUERY PLAN of sql as a tree, nothing is executed
+  inline QueryPlan_t explain(const char *sql) {
+    std::string explainSql = std::string("EXPLAIN QUERY PLAN ") + sql;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, explainSql.c_str(), -1, &stmt, nullptr) !=
+        SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Explain"), sqlite3_errcode(db));
+
+    // Columns are id, parent, notused, detail. Parents come before their
+    // children, id 0 is the root.
+    struct Line_t {
+      int id, parent;
+      std::string detail;
+    };
+    std::vector<Line_t> lines;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+      lines.push_back({sqlite3_column_int(stmt, 0),
+                       sqlite3_column_int(stmt, 1), detail ? detail : ""});
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE)
+      throw SQL_Error_t(db_error_msg("Explain"), rc);
+
+    std::function<void(int, std::vector<PlanNode_t> &)> build =
+        [&](int parent, std::vector<PlanNode_t> &nodes) {
+          for (const Line_t &line : lines)
+            if (line.parent == parent) {
+              nodes.push_back({line.id, line.detail, {}});
+              build(line.id, nodes.back().children);
+            }
+        };
+    QueryPlan_t plan;
+    build(0, plan.nodes);
+    return plan;
+  }
+
+  // Explains every everyN-th statement run through query/selectFromTable
+  // and reports full scans of tables with at least minRows rows; those
+  // statements and the ones sorting in a temp b-tree feed the index
+  // advisor. everyN 0 turns sampling off.
+  inline void setPlanSampling(unsigned int everyN, long minRows = 10000) {
+    planSampleEvery = everyN;
+    planSampleCount = 0;
+    planMinRows = minRows;
+  }
+
+  inline std::vector<ScanReport_t> scanReports() const {
+    std::vector<ScanReport_t> reports;
+    for (const auto &report : scans)
+      reports.push_back(report.second);
+    return reports;
+  }
+
+  // Indexes that would serve the sampled statements, skipping the ones an
+  // existing index already covers
+  inline std::vector<IndexAdvice_t> indexAdvice() {
+    if (!schema.refresh(db))
+      throw SQL_Error_t(db_error_msg("Schema"), sqlite3_errcode(db));
+    return advisor.advise(schema);
+  }
+
+  // Index over the columns of the matrix schema, in column order:
+  //   CREATE INDEX IF NOT EXISTS idx_<table>_<col>_<col> ON table (...);
+  inline void createIndex(const char *tableName, const Matrix_t &columns,
+                          bool unique = false) {
+    std::vector<std::string> names;
+    for (size_t c = 0; c < columns.colCount; ++c)
+      names.push_back(columns.getColumnName(c));
+    createIndexOn(tableName, names, unique);
+  }
+  inline void createIndex(const IndexAdvice_t &advice) {
+    createIndexOn(advice.table.c_str(), advice.columns, false);
+  }
 
-    return queryToTable(sql_str);
+  // Online backup of the main database into destFile. Copies pagesPerStep
+  // pages at a time and sleeps sleepMs between steps so writers can take the
+  // lock in between. Pass pagesPerStep < 0 to copy everything in one step.
+  // Throws an SQL_Error_t with busy() set when a lock stalls the copy for
+  // busyTimeoutMs.
+  inline void backupTo(const char *destFile, int pagesPerStep = 64,
+                       int sleepMs = 10, BackupProgress_t progress = nullptr,
+                       int busyTimeoutMs = backupBusyTimeoutMs) {
+    sqlite3 *dest;
+    if (sqlite3_open_v2(destFile, &dest,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                        nullptr) != SQLITE_OK) {
+      std::string msg = db_error_msg("Backup Open", dest);
+      sqlite3_close_v2(dest);
+      throw std::runtime_error(msg);
+    }
+
+    int rc = copyDatabase(db, dest, pagesPerStep, sleepMs, progress,
+                          busyTimeoutMs);
+    if (rc != SQLITE_DONE) {
+      std::string msg = std::string("Backup Error: ") + sqlite3_errstr(rc);
+      sqlite3_close_v2(dest);
+      throw SQL_Error_t(msg, rc);
+    }
+    sqlite3_close_v2(dest);
+  }
+
+  // Compacted copy of the database through VACUUM INTO, destFile must not
+  // exist yet
+  inline void vacuumInto(const char *destFile) {
+    // %Q quotes the path as an SQL string literal
+    char *buffer = sqlite3_mprintf("VACUUM INTO %Q;", destFile);
+    if (buffer == nullptr)
+      throw std::bad_alloc();
+    try {
+      execSimpleSQL(buffer);
+    } catch (...) {
+      sqlite3_free(buffer);
+      throw;
+    }
+    sqlite3_free(buffer);
   }
 
 private:
-  sqlite3 *db;
+  sqlite3 *db = nullptr;
   std::string filename;
-  char *sql_err;
+  char *sql_err = nullptr;
+
+  // Memory mode only
+  sqlite3 *disk = nullptr;
+  std::thread persister;
+  std::mutex persistLock;
+  std::condition_variable persistCv;
+  bool stopPersist = false;
+  long persistedChanges = 0;
+  static const int persistPagesPerStep = 256;
+  // Backups and persists wait this long for a lock before giving up
+  static constexpr int backupBusyTimeoutMs = 5000;
+  static constexpr int backupBusySleepMs = 5;
+
+  // "table.column" -> codec
+  std::unordered_map<std::string, std::shared_ptr<const Codec_t>> columnCodecs;
+  std::unordered_map<std::string, TimeSeries_t> timeSeries; // by name
+  bool seriesStale = false; // a rollback may have undone partition changes
+  size_t dictionaryLimit = 0; // see setDictionaryEncoding
+
+  // Matrices registered as virtual tables, by table name
+  MatrixSources_t matrixSources;
+  bool matrixModule = false;
+
+  // selectByKeys statements by "table.column", finalized on close
+  std::unordered_map<std::string, sqlite3_stmt *> keyLookupStatements;
+  bool arrayModule = false;
+
+  SchemaCatalog_t schema;
+  BusyScheduler_t busy;
+  ChangeCapture_t capture;
+
+  // Plan sampling, see setPlanSampling
+  unsigned int planSampleEvery = 0;
+  unsigned long planSampleCount = 0;
+  long planMinRows = 10000;
+  // By table and normalized sql, at most PLAN_MAX_SCAN_REPORTS
+  std::unordered_map<std::string, ScanReport_t> scans;
+  // Counted rows by table, with the changeCounter they were counted at
+  std::unordered_map<std::string, std::pair<long, long>> rowCounts;
+  IndexAdvisor_t advisor;
+
+  // Caller holds persistLock. Steps through the copy without sleeping,
+  // writes on db in between steps are picked up by the running backup.
+  // An open transaction keeps the backup from reading db, so the persist
+  // is left to the next tick instead of waiting for the commit.
+  inline bool persistLocked() {
+    long changes = changeCounter();
+    if (changes == persistedChanges || sqlite3_get_autocommit(db) == 0)
+      return true;
+
+    if (copyDatabase(db, disk, persistPagesPerStep, 0, nullptr) !=
+        SQLITE_DONE)
+      return false;
+
+    persistedChanges = changes;
+    return true;
+  }
 
-  inline Matrix_t queryToTable(const char *query) {
-    Matrix_t selection;
+  // Grows with every row change and every schema change on db, total_changes
+  // alone does not see DDL
+  inline long changeCounter() {
+    long schemaVersion = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA schema_version;", -1, &stmt,
+                           nullptr) == SQLITE_OK) {
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        schemaVersion = sqlite3_column_int64(stmt, 0);
+      sqlite3_finalize(stmt);
+    }
+    return sqlite3_total_changes64(db) + schemaVersion;
+  }
+
+  inline void createIndexOn(const char *tableName,
+                            const std::vector<std::string> &columns,
+                            bool unique) {
+    if (columns.empty())
+      throw std::runtime_error("Index Error: no columns");
+
+    std::string indexName = std::string("idx_") + tableName;
+    std::string columnList;
+    for (const std::string &c : columns) {
+      indexName += "_" + c;
+      columnList += (columnList.empty() ? "" : ", ") + c;
+    }
+
+    const char *fmt_str = "CREATE %sINDEX IF NOT EXISTS %s ON %s (%s);";
+    const char *kind = unique ? "UNIQUE " : "";
+    size_t bufSize = snprintf(NULL, 0, fmt_str, kind, indexName.c_str(),
+                              tableName, columnList.c_str()) +
+                     1;
+    char *buffer = (char *)malloc(bufSize);
+    sprintf(buffer, fmt_str, kind, indexName.c_str(), tableName,
+            columnList.c_str());
+    try {
+      execSimpleSQL(buffer);
+    } catch (const std::runtime_error &) {
+      free(buffer);
+      throw;
+    }
+    free(buffer);
+  }
+
+  // Sampling must never fail the statement it looks at, errors are dropped
+  inline void samplePlan(const char *sql) {
+    if (planSampleEvery == 0 || ++planSampleCount % planSampleEvery != 0)
+      return;
+
+    QueryPlan_t plan;
+    try {
+      plan = explain(sql);
+    } catch (const std::runtime_error &) {
+      return;
+    }
+
+    bool advise = plan.sortsWithTempBTree();
+    for (const std::string &table : plan.scannedTables()) {
+      std::string name = table;
+      long rows;
+      try {
+        rows = tableRows(name.c_str());
+        if (rows < 0) {
+          name = aliasedTable(sql, table);
+          rows = tableRows(name.c_str());
+        }
+      } catch (const std::runtime_error &) {
+        return;
+      }
+      if (rows < planMinRows)
+        continue;
+
+      std::string key = name + "|" + normalizeSQL(sql);
+      if (scans.size() >= PLAN_MAX_SCAN_REPORTS && !scans.count(key))
+        scans.erase(std::min_element(
+            scans.begin(), scans.end(), [](const auto &a, const auto &b) {
+              return a.second.samples < b.second.samples;
+            }));
+      ScanReport_t &report = scans[key];
+      report.sql = sql;
+      report.table = name;
+      report.rows = rows;
+      report.samples++;
+      advise = true;
+    }
+    if (advise)
+      advisor.observe(sql);
+  }
+
+  // Row count of tableName, from sqlite_stat1 once ANALYZE ran, estimated
+  // from the largest rowid otherwise so a sample never scans the table, and
+  // kept until the next change on db. Deletes below the largest rowid go
+  // unseen until ANALYZE, WITHOUT ROWID tables count as empty. -1 for
+  // anything that is not a table of the main database.
+  inline long tableRows(const char *tableName) {
+    const TableInfo_t *table = tableInfo(tableName);
+    if (table == nullptr)
+      return -1;
+    std::string name = table->name;
+
+    long changes = changeCounter();
+    auto cached = rowCounts.find(name);
+    if (cached != rowCounts.end() && cached->second.first == changes)
+      return cached->second.second;
+
+    // The table row of sqlite_stat1, or any index row, starts with the
+    // row count
+    long rows = -1;
+    if (tableInfo("sqlite_stat1") != nullptr)
+      rows = singleInt(
+          "SELECT stat FROM sqlite_stat1 WHERE tbl = %Q "
+          "ORDER BY idx IS NOT NULL LIMIT 1;",
+          name.c_str());
+    if (rows < 0)
+      rows = std::max(
+          0L, singleInt("SELECT max(rowid) FROM \"%w\";", name.c_str()));
+
+    if (rowCounts.size() >= PLAN_MAX_SCAN_REPORTS)
+      rowCounts.clear();
+    rowCounts[name] = {changes, rows};
+    return rows;
+  }
+
+  // Leading integer of the first column of the first row of the statement
+  // sqlite3_mprintf builds from fmt_str and name, -1 without one
+  inline long singleInt(const char *fmt_str, const char *name) {
+    char *sql_str = sqlite3_mprintf(fmt_str, name);
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, sql_str, -1, &stmt, nullptr);
+    sqlite3_free(sql_str);
+    if (rc != SQLITE_OK)
+      return -1;
+
+    long value = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+      value = atol((const char *)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    return value;
+  }
+
+  // Codecs of a table column, nullptr for plain columns
+  inline const Codec_t *codecFor(const char *tableName, const char *colName) {
+    if (tableName == nullptr || columnCodecs.empty())
+      return nullptr;
+    auto it = columnCodecs.find(std::string(tableName) + "." + colName);
+    return it == columnCodecs.end() ? nullptr : it->second.get();
+  }
+
+  inline Matrix_t queryToTable(const char *query,
+                               const char *tableName = nullptr,
+                               const ArrayParam_t *array = nullptr) {
     sqlite3_stmt *stmt;
 
     if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) != SQLITE_OK) {
-      throw std::runtime_error(db_error_msg("Prepare"));
+      throw SQL_Error_t(db_error_msg("Prepare"), sqlite3_errcode(db));
+    }
+    samplePlan(query);
+    if (array != nullptr && array->bind(stmt, 1) != SQLITE_OK) {
+      sqlite3_finalize(stmt);
+      throw SQL_Error_t(db_error_msg("Bind"), sqlite3_errcode(db));
+    }
+
+    try {
+      Matrix_t selection = stmtToTable(stmt, tableName);
+      sqlite3_finalize(stmt);
+      return selection;
+    } catch (const std::runtime_error &) {
+      sqlite3_finalize(stmt);
+      throw;
     }
+  }
 
+  // Steps a prepared statement into a matrix and resets it for reuse
+  inline Matrix_t stmtToTable(sqlite3_stmt *stmt, const char *tableName) {
     size_t colCount = sqlite3_column_count(stmt);
-    selection = Matrix_t(colCount);
+    Matrix_t selection = Matrix_t(colCount);
+    if (tableName != nullptr)
+      snprintf(selection.name, MAX_TABLE_NAME_LENGTH, "%s", tableName);
 
+    std::vector<const Codec_t *> codecs(colCount);
     for (size_t i = 0; i < colCount; ++i) {
-      strcpy(selection.columnNames + (i * MAX_COLUMN_NAME_LENGTH),
-             sqlite3_column_name(stmt, i));
-      printf("%s", selection.columnNames + (i * MAX_COLUMN_NAME_LENGTH));
+      selection.setColumnName(sqlite3_column_name(stmt, i), i);
+      codecs[i] = codecFor(tableName, selection.getColumnName(i));
+#ifdef SQLITE_ENABLE_COLUMN_METADATA
+      if (codecs[i] == nullptr && sqlite3_column_table_name(stmt, i))
+        codecs[i] = codecFor(sqlite3_column_table_name(stmt, i),
+                             sqlite3_column_origin_name(stmt, i));
+#endif
     }
 
+    std::vector<std::shared_ptr<Dictionary_t>> dictionaries(colCount);
     Row_t r = Row_t(colCount);
-    do {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      SqlValue *cells = r.editValues();
       for (size_t i = 0; i < colCount; ++i) {
-        r.values[i].from_column(stmt, i);
+        if (dictionaryLimit != 0 && codecs[i] == nullptr &&
+            sqlite3_column_type(stmt, i) == SQLITE_TEXT)
+          cells[i] = internText(stmt, i, dictionaries[i], selection);
+        else
+          cells[i] = SqlValue::from_column(stmt, i, codecs[i]);
       }
-      selection.appendRow(r);
-    } while (sqlite3_step(stmt) == SQLITE_ROW);
+      // Moved in so the values are taken over instead of copied
+      selection.appendRow(std::move(r));
+      r = Row_t(colCount);
+    }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+      throw SQL_Error_t(db_error_msg("Step"), rc);
     return selection;
   }
 
-  inline void execSimpleSQL(const char *sql_str) {
-    if (sqlite3_exec(db, sql_str, nullptr, nullptr, &sql_err) != SQLITE_OK)
-      throw std::runtime_error(sql_error());
+  // Text of column col borrowed from the dictionary of the result column,
+  // created on first use. Only the selection holds the dictionary, so it
+  // can still grow here.
+  inline SqlValue internText(sqlite3_stmt *stmt, int col,
+                             std::shared_ptr<Dictionary_t> &dict,
+                             Matrix_t &selection) {
+    const char *p = (const char *)sqlite3_column_text(stmt, col);
+    size_t n = sqlite3_column_bytes(stmt, col);
+    if (!dict) {
+      dict = std::make_shared<Dictionary_t>();
+      selection.setColumnDictionary(col, dict);
+    }
+
+    uint32_t code = (dict->size() < dictionaryLimit) ? dict->intern(p, n)
+                                                     : dict->find(p, n);
+    if (code == NO_DICTIONARY_CODE)
+      return SqlValue(p, n);
+    return dict->value(code);
   }
 
-  inline const char *db_error_msg(const char *error) {
+  // "INSERT INTO name (columns) VALUES (?, ...);" for the matrix columns,
+  // into tableName instead of the matrix name when given
+  inline sqlite3_stmt *prepareInsert(Matrix_t &matrix,
+                                     const char *tableName = nullptr) {
+    const char *fmt_str = "INSERT INTO %s (%s) VALUES (%s);";
+    if (tableName == nullptr)
+      tableName = matrix.name;
+
+    std::string params;
+    for (size_t c = 0; c < matrix.colCount; ++c)
+      params += (c == 0) ? "?" : ", ?";
+
+    const char *names = matrix.getSQLColumnNamesString();
     size_t bufSize =
-        snprintf(NULL, 0, "%s Error: %s", error, sqlite3_errmsg(db));
-    char *buffer = (char *)malloc(bufSize);
-    sprintf(buffer, "%s Error: %s", error, sqlite3_errmsg(db));
-    return buffer;
+        snprintf(NULL, 0, fmt_str, tableName, names, params.c_str()) + 1;
+    char *sql_str = (char *)malloc(bufSize);
+    sprintf(sql_str, fmt_str, tableName, names, params.c_str());
+    free((void *)names);
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, sql_str, -1, &stmt, nullptr);
+    free(sql_str);
+    if (rc != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Prepare"), sqlite3_errcode(db));
+    return stmt;
   }
 
-  inline const char *sql_error() {
-    size_t bufSize = snprintf(NULL, 0, "SQL Error: %s", sql_err);
-    char *buffer = (char *)malloc(bufSize);
-    sprintf(buffer, "SQL Error: %s", sql_err);
-    return buffer;
+  inline void bindAndStep(sqlite3_stmt *stmt, Matrix_t &matrix, Row_t &row) {
+    for (size_t c = 0; c < row.colCount; ++c) {
+      const Codec_t *codec = matrix.getColumnCodec(c).get();
+      if (codec == nullptr)
+        codec = codecFor(matrix.name, matrix.getColumnName(c));
+
+      if (row.getValues()[c].bind(stmt, c + 1, codec) != SQLITE_OK)
+        throw SQL_Error_t(db_error_msg("Bind"), sqlite3_errcode(db));
+    }
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE)
+      throw SQL_Error_t(db_error_msg("Step"), rc);
+  }
+
+  inline TimeSeries_t &findSeries(const char *name) {
+    reloadStaleSeries();
+    auto it = timeSeries.find(name);
+    if (it == timeSeries.end())
+      throw std::runtime_error(
+          std::string("TimeSeries Error: no such time series: ") + name);
+    return it->second;
+  }
+
+  // Caller runs in a transaction. Rows already past retention are skipped.
+  inline void insertIntoSeries(TimeSeries_t &series, Matrix_t &matrix,
+                               Row_t &row) {
+    reloadStaleSeries();
+    const SqlValue &time = row.getValues()[series.timeIdx];
+    if (time.type() != SqlValue::Integer)
+      throw std::runtime_error(std::string("TimeSeries Error: ") +
+                               series.timeCol + " is not an Integer");
+    long start = series.partitionStart(time.as_int());
+    if (series.pastRetention(start, series.newest))
+      return;
+
+    bool created = series.partitions.count(start) == 0;
+    if (created)
+      createPartition(series, start, matrix, row);
+
+    sqlite3_stmt *stmt = series.hotInsert(start);
+    bool hot = stmt != nullptr;
+    if (!hot)
+      stmt = prepareInsert(
+          matrix, TimeSeries_t::quoted(series.partitions[start]).c_str());
+    try {
+      bindAndStep(stmt, matrix, row);
+    } catch (const std::runtime_error &) {
+      if (!hot)
+        sqlite3_finalize(stmt);
+      throw;
+    }
+    if (!hot && !series.keepHot(start, stmt))
+      sqlite3_finalize(stmt);
+
+    if (time.as_int() > series.newest) {
+      series.newest = time.as_int();
+      if (created)
+        expireTimeSeries(series.name.c_str(), series.newest);
+    }
+  }
+
+  // Table and time index of a new partition, column types are taken from
+  // the first row it gets
+  inline void createPartition(TimeSeries_t &series, long start,
+                              Matrix_t &matrix, Row_t &row) {
+    std::string table = series.partitionName(start);
+    std::string sql =
+        "CREATE TABLE IF NOT EXISTS " + TimeSeries_t::quoted(table) + " (";
+    for (size_t c = 0; c < matrix.colCount; ++c) {
+      sql += (c == 0) ? "" : ", ";
+      sql += TimeSeries_t::quoted(series.columns[c]);
+      if (matrix.getColumnCodec(c) ||
+          codecFor(series.name.c_str(), matrix.getColumnName(c)))
+        sql += " BLOB";
+      else if (row.getValues()[c].type() != SqlValue::Null)
+        sql += std::string(" ") + row.getValues()[c].typeString();
+    }
+    sql += "); CREATE INDEX IF NOT EXISTS " +
+           TimeSeries_t::quoted("idx_" + table + "_" + series.timeCol) +
+           " ON " + TimeSeries_t::quoted(table) + " (" +
+           TimeSeries_t::quoted(series.timeCol) + ");";
+    execSimpleSQL(sql.c_str());
+
+    series.partitions[start] = table;
+    refreshSeriesView(series);
+  }
+
+  inline void dropPartition(TimeSeries_t &series, long start) {
+    std::string sql = "DROP TABLE IF EXISTS " +
+                      TimeSeries_t::quoted(series.partitionName(start)) + ";";
+    execSimpleSQL(sql.c_str());
+  }
+
+  // The view under the series name covers every partition
+  inline void refreshSeriesView(TimeSeries_t &series) {
+    std::string view = TimeSeries_t::quoted(series.name);
+    std::string sql = "DROP VIEW IF EXISTS " + view + "; CREATE VIEW " +
+                      view + " AS " +
+                      series.unionOf(series.allPartitions(), false) + ";";
+    execSimpleSQL(sql.c_str());
+  }
+
+  // Partitions from sqlite_master, newest from the latest partition's rows
+  inline void loadPartitions(TimeSeries_t &series) {
+    series.finalize();
+    series.partitions.clear();
+    Matrix_t tables =
+        queryToTable("SELECT name FROM sqlite_master WHERE type = 'table';");
+    for (size_t r = 0; r < tables.rowCount; ++r) {
+      long start;
+      const char *table = tables.getValues()[r].as_text();
+      if (series.parsePartition(table, start))
+        series.partitions[start] = table;
+    }
+
+    series.newest = LONG_MIN;
+    if (series.partitions.empty())
+      return;
+    auto latest = series.partitions.rbegin();
+    std::string sql = "SELECT max(" + TimeSeries_t::quoted(series.timeCol) +
+                      ") FROM " + TimeSeries_t::quoted(latest->second) + ";";
+    Matrix_t newest = queryToTable(sql.c_str());
+    series.newest = (newest.rowCount == 1 &&
+                     newest.getValues()[0].type() == SqlValue::Integer)
+                        ? newest.getValues()[0].as_int()
+                        : latest->first;
+  }
+
+  // Partitions and hot inserts may name tables a rollback took back, or
+  // miss ones it restored
+  inline void reloadStaleSeries() {
+    if (!seriesStale)
+      return;
+    for (auto &series : timeSeries)
+      loadPartitions(series.second);
+    seriesStale = false;
+  }
+
+  inline void ensureArrayModule() {
+    if (arrayModule)
+      return;
+    if (sqlite3_create_module_v2(db, ARRAY_MODULE_NAME, ArrayVTab_t::module(),
+                                 nullptr, nullptr) != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Create Module"), sqlite3_errcode(db));
+    arrayModule = true;
+  }
+
+  inline sqlite3_stmt *keyLookupStatement(const char *tableName,
+                                          const char *keyCol) {
+    std::string key = std::string(tableName) + "." + keyCol;
+    auto it = keyLookupStatements.find(key);
+    if (it != keyLookupStatements.end())
+      return it->second;
+
+    const char *fmt_str = "SELECT * FROM %s WHERE %s IN %s(?1);";
+    size_t bufSize =
+        snprintf(NULL, 0, fmt_str, tableName, keyCol, ARRAY_MODULE_NAME) + 1;
+    char *sql_str = (char *)malloc(bufSize);
+    sprintf(sql_str, fmt_str, tableName, keyCol, ARRAY_MODULE_NAME);
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v3(db, sql_str, -1, SQLITE_PREPARE_PERSISTENT,
+                                &stmt, nullptr);
+    free(sql_str);
+    if (rc != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Prepare"), sqlite3_errcode(db));
+
+    keyLookupStatements.emplace(key, stmt);
+    return stmt;
+  }
+
+  static inline int functionFlags(bool deterministic) {
+    return SQLITE_UTF8 | (deterministic ? SQLITE_DETERMINISTIC : 0);
+  }
+
+  // SQLite owns holder from here on and deletes it, also on failure
+  inline void createFunction(const char *name, int argCount,
+                             bool deterministic, FunctionHolder_t *holder) {
+    if (sqlite3_create_function_v2(db, name, argCount,
+                                   functionFlags(deterministic), holder,
+                                   FunctionHolder_t::scalar, nullptr, nullptr,
+                                   FunctionHolder_t::destroy) != SQLITE_OK)
+      throw SQL_Error_t(db_error_msg("Create Function"), sqlite3_errcode(db));
+  }
+
+  // Runs a backup from src into dest step by step, returns the last
+  // sqlite3_backup_step code (SQLITE_DONE on success). Gives up with
+  // SQLITE_BUSY once a lock held on either side keeps the copy from
+  // making progress for busyTimeoutMs.
+  static inline int copyDatabase(sqlite3 *src, sqlite3 *dest,
+                                 int pagesPerStep, int sleepMs,
+                                 BackupProgress_t progress,
+                                 int busyTimeoutMs = backupBusyTimeoutMs) {
+    sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+    if (backup == nullptr)
+      return sqlite3_errcode(dest);
+
+    int rc;
+    int waitedMs = 0;
+    for (;;) {
+      rc = sqlite3_backup_step(backup, pagesPerStep);
+      if (progress)
+        progress(sqlite3_backup_remaining(backup),
+                 sqlite3_backup_pagecount(backup));
+
+      if (rc == SQLITE_OK) {
+        waitedMs = 0;
+        if (sleepMs > 0)
+          sqlite3_sleep(sleepMs);
+      } else if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        if (waitedMs >= busyTimeoutMs) {
+          rc = SQLITE_BUSY;
+          break;
+        }
+        int pause = std::max(sleepMs, backupBusySleepMs);
+        sqlite3_sleep(pause);
+        waitedMs += pause;
+      } else {
+        break;
+      }
+    }
+
+    sqlite3_backup_finish(backup);
+    return rc;
+  }
+
+  inline void execSimpleSQL(const char *sql_str) {
+    int rc = sqlite3_exec(db, sql_str, nullptr, nullptr, &sql_err);
+    if (rc != SQLITE_OK)
+      throw SQL_Error_t(sql_error(), rc);
+  }
+
+  inline std::string db_error_msg(const char *error,
+                                  sqlite3 *handle = nullptr) {
+    if (handle == nullptr)
+      handle = db;
+    return std::string(error) + " Error: " + sqlite3_errmsg(handle);
+  }
+
+  // Takes sql_err from sqlite3_exec
+  inline std::string sql_error() {
+    std::string msg = std::string("SQL Error: ") + (sql_err ? sql_err : "");
+    sqlite3_free(sql_err);
+    sql_err = nullptr;
+    return msg;
   }
 };
 
@@ -0,0 +1,582 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <malloc.h>
+#include <memory>
+#include <sqlite3.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "SQL_Wrapper.h"
+
+using namespace SQL;
+using Clock = std::chrono::steady_clock;
+
+const char *bench_db = "bench.db";
+const char *bench_backup = "bench_backup.db";
+const char *bench_codec_db = "bench_codec.db";
+const char *bench_busy_db = "bench_busy.db";
+const char *bench_snapshot = "bench.snapshot";
+const char *bench_series_db = "bench_series.db";
+
+void println(std::string str) { std::cout << str << std::endl; }
+
+void seed(const char *filename, int rows) {
+  sqlite3 *db;
+  sqlite3_open_v2(filename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                  nullptr);
+  sqlite3_exec(db,
+               "DROP TABLE IF EXISTS bench;"
+               "CREATE TABLE bench (id INTEGER PRIMARY KEY, payload TEXT);"
+               "BEGIN;",
+               nullptr, nullptr, nullptr);
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO bench (payload) VALUES (?);", -1, &stmt,
+                     nullptr);
+  std::string payload(200, 'x');
+  for (int i = 0; i < rows; ++i) {
+    sqlite3_bind_text(stmt, 1, payload.c_str(), payload.size(),
+                      SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+  sqlite3_close_v2(db);
+}
+
+void printLatencies(const char *label, std::vector<double> &us) {
+  if (us.empty()) {
+    println(std::string(label) + ": no samples");
+    return;
+  }
+  std::sort(us.begin(), us.end());
+  char line[256];
+  snprintf(line, sizeof(line),
+           "%-28s n=%-6zu p50=%8.1fus p99=%8.1fus max=%9.1fus", label,
+           us.size(), us[us.size() / 2], us[(us.size() * 99) / 100],
+           us.back());
+  println(line);
+}
+
+// Inserts one row roughly every millisecond for durationMs on its own
+// connection, recording the latency of every insert
+std::vector<double> runWriter(int durationMs) {
+  sqlite3 *db;
+  sqlite3_open_v2(bench_db, &db, SQLITE_OPEN_READWRITE, nullptr);
+  sqlite3_busy_timeout(db, 5000);
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO bench (payload) VALUES ('writer');", -1,
+                     &stmt, nullptr);
+
+  std::vector<double> latencies;
+  auto end = Clock::now() + std::chrono::milliseconds(durationMs);
+  while (Clock::now() < end) {
+    auto start = Clock::now();
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  sqlite3_finalize(stmt);
+  sqlite3_close_v2(db);
+  return latencies;
+}
+
+void benchBackup(const char *label, int pagesPerStep, int sleepMs) {
+  std::filesystem::remove(bench_backup);
+
+  std::vector<double> latencies;
+  std::thread writer([&]() { latencies = runWriter(1000); });
+
+  auto start = Clock::now();
+  if (pagesPerStep != 0) {
+    SQL_DB sql(bench_db);
+    sql.backupTo(bench_backup, pagesPerStep, sleepMs);
+  }
+  double backupMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  writer.join();
+  printLatencies(label, latencies);
+  if (pagesPerStep != 0)
+    printf("%-28s backup took %.1fms\n", "", backupMs);
+}
+
+void benchVacuumInto() {
+  std::filesystem::remove(bench_backup);
+
+  auto start = Clock::now();
+  SQL_DB sql(bench_db);
+  sql.vacuumInto(bench_backup);
+  double ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  printf("%-28s %.1fms, %ju -> %ju bytes\n", "vacuum into", ms,
+         (uintmax_t)std::filesystem::file_size(bench_db),
+         (uintmax_t)std::filesystem::file_size(bench_backup));
+}
+
+// Log lines shaped like our JSON payloads, repetitive keys with varying ids
+std::vector<std::string> logPayloads(int count) {
+  const char *hosts[] = {"web-01", "web-02", "db-01", "cache-07"};
+  const char *paths[] = {"/api/v1/items", "/api/v1/users", "/healthz"};
+  std::vector<std::string> payloads;
+  for (int i = 0; i < count; ++i) {
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"ts\":%d,\"host\":\"%s\",\"level\":\"info\","
+             "\"method\":\"GET\",\"path\":\"%s/%d\",\"status\":%d,"
+             "\"latency_ms\":%d,\"user_agent\":\"Mozilla/5.0 (X11; Linux "
+             "x86_64)\",\"request_id\":\"%08x-%04x\"}",
+             1700000000 + i, hosts[i % 4], paths[i % 3], i * 7919 % 100000,
+             (i % 50 == 0) ? 500 : 200, i * 31 % 900, i * 2654435761u,
+             i % 65536);
+    payloads.push_back(line);
+  }
+  return payloads;
+}
+
+void benchCodec(const char *label, std::shared_ptr<const Codec_t> codec,
+                const std::vector<std::string> &payloads) {
+  size_t rawBytes = 0;
+  for (const std::string &p : payloads)
+    rawBytes += p.size();
+
+  size_t compressedBytes = rawBytes;
+  double compressMs = 0, decompressMs = 0;
+  if (codec) {
+    std::vector<std::vector<uint8_t>> compressed(payloads.size());
+    auto start = Clock::now();
+    for (size_t i = 0; i < payloads.size(); ++i)
+      codec->compress((const uint8_t *)payloads[i].data(), payloads[i].size(),
+                      compressed[i]);
+    compressMs =
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    compressedBytes = 0;
+    std::vector<uint8_t> out(512);
+    start = Clock::now();
+    for (size_t i = 0; i < payloads.size(); ++i) {
+      codec->decompress(compressed[i].data(), compressed[i].size(), out.data(),
+                        payloads[i].size());
+      compressedBytes += compressed[i].size() + CODEC_HEADER_SIZE;
+    }
+    decompressMs =
+        std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+  // Same rows through the wrapper into a fresh file
+  std::filesystem::remove(bench_codec_db);
+  Matrix_t matrix = Matrix_t("logs", 2);
+  matrix.setColumnName("id", 0);
+  matrix.setColumnName("payload", 1);
+  matrix.editValues()[0] = SqlValue(0L);
+  matrix.editValues()[1] = SqlValue("");
+  matrix.setColumnCodec(1, codec);
+
+  std::vector<Row_t> rows;
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    Row_t r = Row_t(2);
+    r.insertValue((long)i, 0);
+    r.insertValue(payloads[i].c_str(), 1);
+    rows.push_back(r);
+  }
+
+  auto start = Clock::now();
+  {
+    SQL_DB sql(bench_codec_db);
+    sql.createTable(matrix, 0);
+    sql.insertManySameTypeInto(matrix, rows.data(), rows.size());
+  }
+  double insertMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  double rawMB = rawBytes / (1024.0 * 1024.0);
+  printf("%-22s ratio=%5.2f compress=%7.1fMB/s decompress=%7.1fMB/s "
+         "insert=%7.1fms file=%ju bytes\n",
+         label, (double)rawBytes / compressedBytes,
+         codec ? rawMB / (compressMs / 1000) : 0.0,
+         codec ? rawMB / (decompressMs / 1000) : 0.0, insertMs,
+         (uintmax_t)std::filesystem::file_size(bench_codec_db));
+}
+
+// One short read-then-write transaction, the shape that deadlocks on a
+// deferred BEGIN when two connections upgrade at once
+const char *contention_tx_read = "SELECT count(*) FROM busy;";
+const char *contention_tx_write = "INSERT INTO busy (worker) VALUES (1);";
+
+// Baseline: sqlite3_busy_timeout with a deferred BEGIN, a failed transaction
+// is not retried. Returns the latency in us, negative on failure.
+double rawTransaction(sqlite3 *db) {
+  auto start = Clock::now();
+  const char *steps[] = {"BEGIN;", contention_tx_read, contention_tx_write,
+                         "COMMIT;"};
+  bool ok = true;
+  for (const char *step : steps)
+    if (ok && sqlite3_exec(db, step, nullptr, nullptr, nullptr) != SQLITE_OK)
+      ok = false;
+  if (!ok)
+    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+  double us =
+      std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+  return ok ? us : -us;
+}
+
+double wrapperTransaction(SQL_DB &sql) {
+  auto start = Clock::now();
+  bool ok = true;
+  try {
+    sql.transaction([&]() {
+      sql.query(contention_tx_read);
+      sql.query(contention_tx_write);
+    });
+  } catch (const std::runtime_error &) {
+    ok = false;
+  }
+  double us =
+      std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+  return ok ? us : -us;
+}
+
+// Forks workers that each run txCount transactions against one file and
+// send their latencies and busy stats back through a pipe
+void benchContention(const char *label, int workers, int txCount,
+                     bool wrapper) {
+  std::filesystem::remove(bench_busy_db);
+  {
+    SQL_DB sql(bench_busy_db);
+    sql.query("CREATE TABLE busy (id INTEGER PRIMARY KEY, worker INTEGER);");
+  }
+
+  std::vector<int> pipes;
+  std::vector<pid_t> children;
+  for (int w = 0; w < workers; ++w) {
+    int fds[2];
+    if (pipe(fds) != 0)
+      return;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      std::vector<double> latencies;
+      BusyStats_t stats;
+      if (wrapper) {
+        SQL_DB sql(bench_busy_db);
+        for (int i = 0; i < txCount; ++i)
+          latencies.push_back(wrapperTransaction(sql));
+        stats = sql.busyStats();
+      } else {
+        sqlite3 *db;
+        sqlite3_open_v2(bench_busy_db, &db, SQLITE_OPEN_READWRITE, nullptr);
+        sqlite3_busy_timeout(db, 5000);
+        for (int i = 0; i < txCount; ++i)
+          latencies.push_back(rawTransaction(db));
+        sqlite3_close_v2(db);
+      }
+      write(fds[1], latencies.data(), latencies.size() * sizeof(double));
+      write(fds[1], &stats, sizeof(stats));
+      close(fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    pipes.push_back(fds[0]);
+    children.push_back(pid);
+  }
+
+  std::vector<double> latencies;
+  BusyStats_t total;
+  size_t failures = 0;
+  for (size_t w = 0; w < pipes.size(); ++w) {
+    std::vector<double> worker(txCount);
+    BusyStats_t stats;
+    read(pipes[w], worker.data(), worker.size() * sizeof(double));
+    read(pipes[w], &stats, sizeof(stats));
+    close(pipes[w]);
+    waitpid(children[w], nullptr, 0);
+
+    for (double us : worker) {
+      if (us < 0)
+        failures++;
+      latencies.push_back(us < 0 ? -us : us);
+    }
+    total.waits += stats.waits;
+    total.retries += stats.retries;
+    total.timeouts += stats.timeouts;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("%-22s failed=%-5zu p50=%8.1fus p99=%9.1fus p99.9=%9.1fus "
+         "max=%9.1fus waits=%ju retries=%ju\n",
+         label, failures, latencies[latencies.size() / 2],
+         latencies[latencies.size() * 99 / 100],
+         latencies[latencies.size() * 999 / 1000], latencies.back(),
+         (uintmax_t)total.waits, (uintmax_t)total.retries);
+}
+
+// Warm start: rebuilding a cache from SQLite against mapping its snapshot.
+// Both sides touch every payload once so the comparison includes reading.
+void benchSnapshot() {
+  auto start = Clock::now();
+  SQL_DB sql(bench_db);
+  Matrix_t cache = sql.selectFromTable("bench");
+  size_t touched = 0;
+  for (size_t r = 0; r < cache.rowCount; ++r)
+    touched += cache.getValues()[r * cache.colCount + 1].bytes();
+  double queryMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  start = Clock::now();
+  MatrixSnapshot_t::save(cache, bench_snapshot);
+  double saveMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  start = Clock::now();
+  MatrixSnapshot_t snapshot(bench_snapshot);
+  size_t mapped = 0;
+  for (size_t r = 0; r < snapshot.rowCount; ++r)
+    mapped += snapshot.bytes(r, 1);
+  double mapMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  printf("%-28s %.1fms (%zu payload bytes)\n", "selectFromTable", queryMs,
+         touched);
+  printf("%-28s %.1fms, %ju bytes\n", "snapshot save", saveMs,
+         (uintmax_t)std::filesystem::file_size(bench_snapshot));
+  printf("%-28s %.1fms (%zu payload bytes)\n", "snapshot map", mapMs, mapped);
+}
+
+// Matrices handed between pipeline stages by value, before copy-on-write
+// every hop duplicated all rows
+size_t passThrough(Matrix_t matrix) { return matrix.rowCount; }
+
+void benchCopies() {
+  SQL_DB sql(bench_db);
+  Matrix_t cache = sql.selectFromTable("bench");
+
+  const int hops = 1000;
+  size_t rows = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < hops; ++i)
+    rows += passThrough(cache);
+  double copyMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  start = Clock::now();
+  Matrix_t detached = cache;
+  detached.detach();
+  double detachMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  printf("%-28s %.3fms for %d copies of %zu rows\n", "pass by value", copyMs,
+         hops, rows / hops);
+  printf("%-28s %.1fms\n", "first write (detach)", detachMs);
+}
+
+// 1M rows of 3 statuses, 8 regions and 300 host names
+const char *dictionary_query =
+    "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n "
+    "WHERE i < 999999) SELECT i, "
+    "CASE i % 3 WHEN 0 THEN 'ok' WHEN 1 THEN 'failed' ELSE 'retry' END, "
+    "'region-' || (i % 8), printf('web-eu-west-1-host-%04d', i % 300) "
+    "FROM n;";
+
+// Bytes in use on the heap, large blocks are mmapped
+size_t heapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+void benchDictionary(const char *label, size_t maxDistinct) {
+  SQL_DB sql(bench_db);
+  sql.setDictionaryEncoding(maxDistinct);
+
+  size_t heapBefore = heapInUse();
+  auto start = Clock::now();
+  Matrix_t result = sql.query(dictionary_query);
+  double queryMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  size_t heap = heapInUse() - heapBefore;
+
+  start = Clock::now();
+  Matrix_t grouped = hashGroupBy(result, {3}, {{0, Aggregate_t::Count}});
+  double groupMs =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+  printf("%-22s heap=%6.1fMB query=%6.1fms group by host=%5.1fms "
+         "(%zu groups)\n",
+         label, heap / 1e6, queryMs, groupMs, grouped.rowCount);
+}
+
+double msSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// 60 days of one reading every 10s into day partitions versus one table
+// indexed on time: ingest of the first and last day, a one day range query
+// and expiring the first 30 days
+void benchTimeSeries(bool partitioned) {
+  std::filesystem::remove(bench_series_db);
+  SQL_DB sql(bench_series_db);
+  Matrix_t readings = Matrix_t("readings", 3);
+  readings.setColumnName("time", 0);
+  readings.setColumnName("sensor", 1);
+  readings.setColumnName("value", 2);
+  if (partitioned)
+    sql.createTimeSeries(readings, "time");
+  else {
+    sql.query("CREATE TABLE readings (time INTEGER, sensor INTEGER, "
+              "value REAL);");
+    sql.query("CREATE INDEX readings_time ON readings (time);");
+  }
+
+  const long day = 86400, step = 10;
+  std::vector<Row_t> rows(day / step);
+  double firstMs = 0, lastMs = 0;
+  for (long d = 0; d < 60; ++d) {
+    for (long i = 0; i < day / step; ++i) {
+      rows[i] = Row_t(3);
+      rows[i].insertValue(d * day + i * step, 0);
+      rows[i].insertValue(i % 64, 1);
+      rows[i].insertValue(0.1 * i, 2);
+    }
+    auto start = Clock::now();
+    sql.insertManySameTypeInto(readings, rows.data(), rows.size());
+    (d == 0 ? firstMs : lastMs) = msSince(start);
+  }
+
+  const char *rangeSql = "SELECT avg(value) FROM readings "
+                         "WHERE time >= 3888000 AND time < 3974400;";
+  auto start = Clock::now();
+  if (partitioned)
+    sql.queryTimeSeries("readings", 45 * day, 46 * day,
+                        "SELECT avg(value) FROM readings;");
+  else
+    sql.query(rangeSql);
+  double rangeMs = msSince(start);
+
+  start = Clock::now();
+  if (partitioned) {
+    TimeSeriesPolicy_t policy;
+    policy.retention = 30 * day;
+    sql.createTimeSeries(readings, "time", policy);
+    sql.expireTimeSeries("readings", 60 * day);
+  } else {
+    sql.query("DELETE FROM readings WHERE time < 2592000;");
+  }
+  double expireMs = msSince(start);
+
+  printf("%-18s ingest day 1=%6.1fms day 60=%6.1fms range=%5.1fms "
+         "expire 30 days=%7.1fms\n",
+         partitioned ? "day partitions" : "single table", firstMs, lastMs,
+         rangeMs, expireMs);
+}
+
+// Small text payloads allocated and freed from every thread, like rows
+// being built and dropped by concurrent queries
+void benchAllocator(const char *label, int threads, bool pooled) {
+  const int rounds = 2000000;
+  auto start = Clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t)
+    workers.emplace_back([pooled]() {
+      void *live[64] = {};
+      for (int i = 0; i < rounds; ++i) {
+        size_t slot = (i * 7) % 64;
+        size_t n = 8 + (i * 37) % 200;
+        if (pooled) {
+          releaseBlock(live[slot]);
+          live[slot] = allocateBlock(n);
+        } else {
+          free(live[slot]);
+          live[slot] = malloc(n);
+        }
+        memset(live[slot], 0, 8);
+      }
+      for (void *p : live)
+        pooled ? releaseBlock(p) : free(p);
+    });
+  for (auto &w : workers)
+    w.join();
+  double ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  printf("%-22s %d threads: %6.1fms (%.0fns per allocation)\n", label,
+         threads, ms, ms * 1e6 / rounds / threads);
+}
+
+void benchPoolStats() {
+  SQL_DB sql(bench_db);
+  Matrix_t cache = sql.selectFromTable("bench");
+  MemoryStats_t s = memoryPool().stats();
+  printf("%-22s %zu rows: in use=%.1fMB in %zu blocks, peak=%.1fMB, "
+         "reserved=%.1fMB\n",
+         "pool after select", cache.rowCount, s.bytesInUse / 1e6,
+         s.blocksInUse, s.peakBytes / 1e6, s.reservedBytes / 1e6);
+}
+
+int main() {
+  println("SQL Wrapper benchmarks");
+
+  println("Backup: writer latency while a backup runs");
+  seed(bench_db, 100000);
+  benchBackup("no backup", 0, 0);
+  benchBackup("backup all at once", -1, 0);
+  benchBackup("backup 64 pages / 10ms", 64, 10);
+  benchBackup("backup 256 pages / 1ms", 256, 1);
+  benchVacuumInto();
+
+  println("Snapshot: rebuilding a 100k row cache");
+  benchSnapshot();
+
+  println("Copy on write: passing a 100k row matrix by value");
+  benchCopies();
+
+  println("Dictionary: 1M rows with three low cardinality text columns");
+  benchDictionary("plain text", 0);
+  benchDictionary("dictionary encoded", 65536);
+
+  println("Time series: 60 days of readings every 10s");
+  benchTimeSeries(false);
+  benchTimeSeries(true);
+
+  println("Allocator: pool against malloc");
+  benchAllocator("malloc", 1, false);
+  benchAllocator("pool", 1, true);
+  benchAllocator("malloc", 8, false);
+  benchAllocator("pool", 8, true);
+  benchPoolStats();
+
+  println("Codec: compression ratio and throughput on log payloads");
+  std::vector<std::string> payloads = logPayloads(20000);
+  std::vector<std::string> samples(payloads.begin(), payloads.begin() + 200);
+  benchCodec("none", nullptr, payloads);
+  benchCodec("zlib level 1", std::make_shared<ZlibCodec_t>(1), payloads);
+  benchCodec("zlib level 6", std::make_shared<ZlibCodec_t>(6), payloads);
+  benchCodec("zlib level 6 + dict",
+             std::make_shared<ZlibCodec_t>(6, ZlibCodec_t::train(samples)),
+             payloads);
+
+  println("Busy: 8 processes contending for one file");
+  benchContention("busy_timeout, BEGIN", 8, 500, false);
+  benchContention("transaction()", 8, 500, true);
+
+  std::filesystem::remove(bench_db);
+  std::filesystem::remove(bench_backup);
+  std::filesystem::remove(bench_codec_db);
+  std::filesystem::remove(bench_busy_db);
+  std::filesystem::remove(bench_snapshot);
+  std::filesystem::remove(bench_series_db);
+  return 0;
+}
@@ -1,3 +1,5 @@
+#include <climits>
+#include <cstdio>
 #include <cstring>
 #include <exception>
 #include <format>
@@ -6,6 +8,9 @@
 
 #include "SQL_Wrapper.h"
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace SQL;
 
@@ -29,17 +34,21 @@ void logLn(TestCond_t t, std::string str) {
   }
 }
 
+static int failures = 0;
+
 void tryFunction(std::function<void()> func, std::string testName) {
   try {
     logLn(START, std::format("Starting test -> {}", testName));
     func();
     logLn(RUNNING, std::format("Ending test"));
+    logLn(SUCCESS, testName);
   } catch (const std::runtime_error &r) {
     logLn(FAIL, r.what());
+    failures++;
   } catch (const std::exception &e) {
     logLn(FAIL, e.what());
+    failures++;
   }
-  logLn(SUCCESS, testName);
 }
 
 int main() {
@@ -54,8 +63,27 @@ int main() {
   auto create_table = []() {
     SQL_DB sql("test.db");
     const char *colNames[2] = {"name", "value"};
-    Matrix_t matrix = Matrix_t("test", 2, colNames);
+    Matrix_t matrix = Matrix_t("test", (size_t)2);
+    for (size_t i = 0; i < 2; ++i)
+      matrix.setColumnName(colNames[i], i);
     sql.createTable(matrix, 0);
+
+    // Failing statements free the SQL they were built into
+    Matrix_t keyword = Matrix_t("bad_table", (size_t)1);
+    keyword.setColumnName("select", 0);
+    int failed = 0;
+    try {
+      sql.createTable(keyword, 0);
+    } catch (const SQL_Error_t &) {
+      failed++;
+    }
+    try {
+      sql.selectFromTable("missing_table");
+    } catch (const SQL_Error_t &) {
+      failed++;
+    }
+    if (failed != 2)
+      throw std::runtime_error("Invalid statements did not fail");
   };
   tryFunction(create_table, "Open, Create");
 
@@ -64,7 +92,9 @@ int main() {
 
     const char *colNames[2] = {"name", "value"};
     const char *testName = "TestName";
-    Matrix_t matrix = Matrix_t("test", 2, colNames);
+    Matrix_t matrix = Matrix_t("test", (size_t)2);
+    for (size_t i = 0; i < 2; ++i)
+      matrix.setColumnName(colNames[i], i);
     Row_t data = Row_t(2);
     data.insertValue(testName, 0);
     data.insertValue((int64_t)1, 1);
@@ -77,9 +107,708 @@ int main() {
     SQL_DB sql("test.db");
 
     Matrix_t matrix = sql.selectFromTable("test");
-    println(matrix.toString());
+    const char *text = matrix.toString();
+    println(text);
+    free((void *)text);
   };
   tryFunction(retrieve_table, "Read db");
 
-  return 0;
+  auto backup_db = []() {
+    SQL_DB sql("test.db");
+    sql.backupTo("test_backup.db", 1, 0, [](int remaining, int pageCount) {
+      println(std::format("Backup {}/{}", pageCount - remaining, pageCount));
+    });
+
+    std::remove("test_vacuum.db");
+    sql.vacuumInto("test_vacuum.db");
+    std::remove("test_vac'uum.db");
+    sql.vacuumInto("test_vac'uum.db");
+    std::remove("test_vac'uum.db");
+
+    // A lock held elsewhere makes the backup give up instead of hanging
+    SQL_DB holder("test.db");
+    holder.query("BEGIN EXCLUSIVE;");
+    bool busy = false;
+    try {
+      sql.backupTo("test_backup.db", 1, 0, nullptr, 50);
+    } catch (const SQL_Error_t &e) {
+      busy = e.busy();
+    }
+    holder.query("ROLLBACK;");
+    if (!busy)
+      throw std::runtime_error("Backup did not time out on a lock");
+  };
+  tryFunction(backup_db, "Backup, Vacuum into");
+
+  auto memory_db = []() {
+    {
+      SQL_DB setup("test.db");
+      Matrix_t matrix = Matrix_t("test", (size_t)1);
+      matrix.setColumnName("name", 0);
+      setup.createTable(matrix, 0);
+    }
+
+    {
+      SQL_DB sql("test.db", SQL_DB::Memory, 100);
+      if (!sql.tableExists("test"))
+        throw std::runtime_error("Table missing after load");
+      sql.transaction([&]() {
+        sql.dropTable("test");
+        sql.persist(); // deferred until the commit
+      });
+      sql.persist();
+    }
+
+    SQL_DB sql("test.db");
+    if (sql.tableExists("test"))
+      throw std::runtime_error("Drop was not persisted");
+  };
+  tryFunction(memory_db, "Memory mode, Persist");
+
+  auto sort_matrix = []() {
+    Matrix_t matrix = Matrix_t(2, 4);
+    const char *names[4] = {"delta", "alpha", "charlie", "alpha"};
+    Row_t r = Row_t(2);
+    for (long i = 0; i < 4; ++i) {
+      r.insertValue(names[i], 0);
+      r.insertValue(i, 1);
+      matrix.appendRow(r);
+    }
+
+    Matrix_t top = matrix.topK(2, {{0}, {1, false}});
+    // Keys built at run time, as from an ORDER BY clause
+    std::vector<SortKey_t> orderBy;
+    orderBy.push_back({1, false});
+    Matrix_t byValue = matrix.topK(1, orderBy);
+    matrix.sortBy({{0}, {1, false}});
+    if (strcmp(matrix.getValues()[0].as_text(), "alpha") != 0 ||
+        matrix.getValues()[1].as_int() != 3 || top.rowCount != 2 ||
+        top.getValues()[3].as_int() != 1 ||
+        byValue.getValues()[1].as_int() != 3)
+      throw std::runtime_error("Unexpected sort order");
+    const char *text = matrix.toString();
+    println(text);
+    free((void *)text);
+
+    // Mixed column, ordered by storage class like SQLite's ORDER BY
+    Matrix_t mixed = Matrix_t(1, 2000);
+    Row_t m = Row_t(1);
+    for (long i = 0; i < 2000; ++i) {
+      long v = (i * 7919) % 2000;
+      switch (i % 5) {
+      case 0:
+        m.insertValue(v, 0);
+        break;
+      case 1:
+        m.insertValue(v + 0.5, 0);
+        break;
+      case 2:
+        m.insertValue(std::to_string(v).c_str(), 0);
+        break;
+      case 3:
+        m.insertValue(SqlValue(), 0);
+        break;
+      default:
+        m.insertValue(SqlValue(&v, sizeof(v)), 0);
+      }
+      mixed.appendRow(m);
+    }
+    Matrix_t lowest = mixed.topK(450, {{0}});
+    mixed.sortBy({{0}});
+    const SqlValue *sorted = mixed.getValues();
+    for (size_t i = 1; i < mixed.rowCount; ++i)
+      if (sorted[i].compare(sorted[i - 1]) < 0)
+        throw std::runtime_error("Mixed column out of order");
+    if (sorted[0].type() != SqlValue::Null ||
+        sorted[400].type() == SqlValue::Null ||
+        sorted[1999].type() != SqlValue::Blob ||
+        lowest.getValues()[449].compare(sorted[449]) != 0)
+      throw std::runtime_error("Mixed column not ordered by storage class");
+  };
+  tryFunction(sort_matrix, "Sort, Top K");
+
+  auto join_group = []() {
+    Matrix_t readings = Matrix_t(2, 4);
+    Matrix_t sensors = Matrix_t(2, 2);
+    Row_t r = Row_t(2);
+    for (long i = 0; i < 4; ++i) {
+      r.insertValue(i % 2, 0);
+      r.insertValue((double)i, 1);
+      readings.appendRow(r);
+    }
+    r.insertValue(0L, 0);
+    r.insertValue("north", 1);
+    sensors.appendRow(r);
+
+    r.insertValue(1.0, 0); // equals Integer 1 as in SQL
+    r.insertValue("12 south", 1);
+    sensors.appendRow(r);
+
+    Matrix_t inner = hashJoin(readings, {0}, sensors, {0});
+    Matrix_t left = hashJoin(readings, {0}, sensors, {0}, JoinType_t::Left);
+    Matrix_t grouped = hashGroupBy(
+        readings, {0}, {{1, Aggregate_t::Sum}, {1, Aggregate_t::Count}});
+    Matrix_t labels = hashGroupBy(sensors, {}, {{1, Aggregate_t::Sum}});
+    // Keys and aggregates built at run time
+    std::vector<size_t> keyCols(1, 0);
+    std::vector<AggregateSpec_t> aggs;
+    aggs.push_back({1, Aggregate_t::Sum});
+    Matrix_t joinedAtRunTime = hashJoin(readings, keyCols, sensors, keyCols);
+    Matrix_t groupedAtRunTime = hashGroupBy(readings, keyCols, aggs);
+    if (joinedAtRunTime.rowCount != 4 || groupedAtRunTime.rowCount != 2)
+      throw std::runtime_error("Run time keys gave another result");
+    if (inner.rowCount != 4 || left.rowCount != 4 || grouped.rowCount != 2 ||
+        grouped.getValues()[1].as_real() != 2.0 ||
+        labels.getValues()[0].as_real() != 12)
+      throw std::runtime_error("Unexpected join or group by result");
+
+    // min('txt', 5) is 5 in SQLite, numbers sort before Text
+    Matrix_t mixed = Matrix_t(1, 2);
+    Row_t m = Row_t(1);
+    m.insertValue("txt", 0);
+    mixed.appendRow(m);
+    m.insertValue(5L, 0);
+    mixed.appendRow(m);
+    Matrix_t extremes =
+        hashGroupBy(mixed, {}, {{0, Aggregate_t::Min}, {0, Aggregate_t::Max}});
+    if (extremes.getValues()[0].type() != SqlValue::Integer ||
+        extremes.getValues()[0].as_int() != 5 ||
+        extremes.getValues()[1].type() != SqlValue::Text)
+      throw std::runtime_error("Unexpected min or max over mixed types");
+
+    // Text would make the Sum Real, only Integers can overflow it
+    Matrix_t big = Matrix_t(1, 2);
+    big.appendRow(m);
+    m.insertValue(LONG_MAX, 0);
+    big.appendRow(m);
+    try {
+      hashGroupBy(big, {}, {{0, Aggregate_t::Sum}});
+      throw std::runtime_error("Integer sum overflowed silently");
+    } catch (const std::runtime_error &e) {
+      if (strstr(e.what(), "integer overflow") == nullptr)
+        throw;
+    }
+    const char *text = grouped.toString();
+    println(text);
+    free((void *)text);
+  };
+  tryFunction(join_group, "Hash join, Group by");
+
+  auto compressed_column = []() {
+    SQL_DB sql("test.db");
+    Matrix_t matrix = Matrix_t("logs", 2);
+    matrix.setColumnName("id", 0);
+    matrix.setColumnName("payload", 1);
+    matrix.editValues()[0] = SqlValue(0L);
+    matrix.editValues()[1] = SqlValue("");
+    matrix.setColumnCodec(
+        1, std::make_shared<ZlibCodec_t>(
+               6, ZlibCodec_t::train({"{\"level\":\"info\",\"msg\":\"a\"}",
+                                      "{\"level\":\"info\",\"msg\":\"b\"}"})));
+    sql.dropTable("logs");
+    sql.createTable(matrix, 0);
+
+    const char *payload = "{\"level\":\"info\",\"msg\":\"started\"}";
+    Row_t data = Row_t(2);
+    data.insertValue(1L, 0);
+    data.insertValue(payload, 1);
+    sql.insertInto(matrix, data);
+
+    Matrix_t logs = sql.selectFromTable("logs");
+    if (logs.rowCount != 1 ||
+        strcmp(logs.getValues()[1].as_text(), payload) != 0)
+      throw std::runtime_error("Compressed column did not round trip");
+
+    // Blobs stored around the codec, one claiming a huge raw size, are
+    // returned as they are
+    sql.query("INSERT INTO logs VALUES (2, x'0300000000ff'), "
+              "(3, x'c55101030000000000000001789c');");
+    logs = sql.selectFromTable("logs");
+    sql.query("DELETE FROM logs WHERE id > 1;");
+    if (logs.rowCount != 3 || logs.getValues()[3].type() != SqlValue::Blob ||
+        logs.getValues()[5].bytes() != 14)
+      throw std::runtime_error("Plain Blob was decoded as a frame");
+  };
+  tryFunction(compressed_column, "Compressed column");
+
+  auto user_functions = []() {
+    SQL_DB sql("test.db");
+    sql.registerFunction("twice", 1, [](int, const SqlValue *argv) {
+      return SqlValue(argv[0].as_int() * 2);
+    });
+    sql.registerTypedFunction("half", [](double x) { return x / 2; });
+    sql.registerAggregate<long>(
+        "longest", 1,
+        [](long &s, int, const SqlValue *argv) {
+          s = std::max(s, (long)argv[0].bytes());
+        },
+        [](long &s) { return SqlValue(s); });
+
+    Matrix_t result =
+        sql.query("SELECT twice(id), half(id), longest(payload) FROM logs;");
+    if (result.rowCount != 1 || result.getValues()[0].as_int() != 2 ||
+        result.getValues()[1].as_real() != 0.5)
+      throw std::runtime_error("Unexpected function results");
+    const char *text = result.toString();
+    println(text);
+    free((void *)text);
+
+    // Exceptions of any type become SQL errors
+    sql.registerFunction("raises", 1, [](int, const SqlValue *) -> SqlValue {
+      throw 1;
+    });
+    sql.registerAggregate<long>(
+        "raises_final", 1, [](long &, int, const SqlValue *) {},
+        [](long &) -> SqlValue { throw 1; });
+    int failed = 0;
+    for (const char *q : {"SELECT raises(id) FROM logs;",
+                          "SELECT raises_final(id) FROM logs WHERE 0;"}) {
+      try {
+        sql.query(q);
+      } catch (const SQL_Error_t &e) {
+        if (strstr(e.what(), "unknown exception"))
+          failed++;
+      }
+    }
+    if (failed != 2)
+      throw std::runtime_error("Unknown exceptions were not reported");
+  };
+  tryFunction(user_functions, "Scalar, Aggregate functions");
+
+  auto matrix_vtab = []() {
+    SQL_DB sql("test.db");
+    Matrix_t feed = Matrix_t(2, 2);
+    feed.setColumnName("id", 0);
+    feed.setColumnName("label", 1);
+    Row_t r = Row_t(2);
+    r.insertValue(1L, 0);
+    r.insertValue("first", 1);
+    feed.appendRow(r);
+
+    sql.registerMatrix("feed", feed, 0);
+    Matrix_t joined = sql.query(
+        "SELECT feed.label FROM logs JOIN feed ON feed.id = logs.id;");
+    if (joined.rowCount != 1 ||
+        strcmp(joined.getValues()[0].as_text(), "first"))
+      throw std::runtime_error("Virtual table join failed");
+
+    // Keyed lookups find each matching row once, whole Reals included
+    Matrix_t byId = sql.query("SELECT label FROM feed WHERE id = 1;");
+    Matrix_t byReal = sql.query("SELECT count(*) FROM feed WHERE id = 1.0;");
+    if (byId.rowCount != 1 || byReal.getValues()[0].as_int() != 1)
+      throw std::runtime_error("Keyed lookup returned duplicate rows");
+    sql.unregisterMatrix("feed");
+  };
+  tryFunction(matrix_vtab, "Matrix virtual table");
+
+  auto select_by_keys = []() {
+    SQL_DB sql("test.db");
+    std::vector<int64_t> ids = {1, 2, 3};
+    Matrix_t rows = sql.selectByKeys("logs", "id", ids);
+    if (rows.rowCount != 1 || rows.getValues()[0].as_int() != 1)
+      throw std::runtime_error("Unexpected multi-get result");
+
+    Column_t keys = Column_t(1);
+    keys.values[0] = SqlValue(1L);
+    Matrix_t counted = sql.query(
+        "SELECT count(*) FROM logs WHERE id IN wrapper_array(?1);",
+        ArrayParam_t(keys));
+    if (counted.getValues()[0].as_int() != 1)
+      throw std::runtime_error("Unexpected array query result");
+  };
+  tryFunction(select_by_keys, "Array binding, Multi-get");
+
+  auto schema_catalog = []() {
+    SQL_DB sql("test.db");
+    const TableInfo_t *logs = sql.tableInfo("logs");
+    if (logs == nullptr || logs->columns.size() != 2 ||
+        logs->primaryKey().front() != "id" ||
+        logs->column("payload")->declType != "BLOB")
+      throw std::runtime_error("Unexpected schema for logs");
+
+    sql.dropTable("logs");
+    if (sql.tableExists("logs"))
+      throw std::runtime_error("Catalog missed the drop");
+
+    // A schema that cannot be read is an error, not a missing table
+    SQL_DB locked("test.db");
+    BusyPolicy_t quick;
+    quick.timeoutMs = 20;
+    locked.setBusyPolicy(quick);
+    sql.query("BEGIN EXCLUSIVE;");
+    bool busy = false;
+    try {
+      locked.tableExists("logs");
+    } catch (const SQL_Error_t &e) {
+      busy = e.busy();
+    }
+    sql.query("ROLLBACK;");
+    if (!busy)
+      throw std::runtime_error("Locked schema read as missing table");
+  };
+  tryFunction(schema_catalog, "Schema catalog");
+
+  auto busy_retry = []() {
+    SQL_DB writer("test.db");
+    SQL_DB blocked("test.db");
+    BusyPolicy_t policy;
+    policy.timeoutMs = 100;
+    policy.lockTimeoutMs = 10;
+    blocked.setBusyPolicy(policy);
+
+    writer.query("BEGIN IMMEDIATE;");
+    try {
+      blocked.transaction([&]() { blocked.query("SELECT 1;"); });
+      throw std::runtime_error("Transaction ran while the lock was held");
+    } catch (const SQL_Error_t &e) {
+      if (!e.busy())
+        throw;
+    }
+    writer.query("COMMIT;");
+
+    blocked.transaction([&]() { blocked.query("SELECT 1;"); });
+    if (blocked.busyStats().waits == 0 || blocked.busyStats().retries == 0)
+      throw std::runtime_error("Busy transaction was never retried");
+  };
+  tryFunction(busy_retry, "Busy backoff, Transaction retry");
+
+  auto plan_advisor = []() {
+    SQL_DB sql("test.db");
+    sql.query("CREATE TABLE readings (sensor TEXT, value REAL);");
+    sql.query("INSERT INTO readings WITH RECURSIVE n(i) AS (SELECT 1 UNION "
+              "ALL SELECT i + 1 FROM n WHERE i < 500) "
+              "SELECT 's' || (i % 7), i FROM n;");
+
+    const char *slow =
+        "SELECT value FROM readings WHERE sensor = 's1' ORDER BY value;";
+    sql.setPlanSampling(1, 100);
+    sql.query(slow);
+    // Same statement with another literal
+    sql.query("SELECT value FROM readings WHERE sensor = 's2' ORDER BY value;");
+    // 50 rows left up to the last rowid, too few to report
+    sql.query("DELETE FROM readings WHERE rowid > 50;");
+    sql.query("SELECT value FROM readings WHERE sensor = 's3' ORDER BY value;");
+    std::vector<IndexAdvice_t> advice = sql.indexAdvice();
+    if (sql.scanReports().size() != 1 || sql.scanReports()[0].samples != 2 ||
+        sql.scanReports()[0].rows != 500 || advice.size() != 1 ||
+        advice[0].columns.size() != 2 || advice[0].columns[1] != "value")
+      throw std::runtime_error("Scan was not reported or advised on");
+
+    Matrix_t columns = Matrix_t(2);
+    columns.setColumnName("sensor", 0);
+    columns.setColumnName("value", 1);
+    sql.createIndex("readings", columns);
+    QueryPlan_t plan = sql.explain(slow);
+    println(plan.toString());
+    if (!plan.scannedTables().empty() || !sql.indexAdvice().empty())
+      throw std::runtime_error("Index was not used");
+    sql.dropTable("readings");
+  };
+  tryFunction(plan_advisor, "Query plan, Index advisor");
+
+  auto change_capture = []() {
+    SQL_DB sql("test.db");
+    sql.query("CREATE TABLE kv (k TEXT, v INTEGER);");
+    std::shared_ptr<ChangeStream_t> stream = sql.captureChanges();
+
+    sql.transaction([&]() {
+      sql.query("INSERT INTO kv VALUES ('a', 1);");
+      sql.query("UPDATE kv SET v = 2 WHERE k = 'a';");
+    });
+    try {
+      sql.transaction([&]() {
+        sql.query("DELETE FROM kv;");
+        throw std::runtime_error("rolled back");
+      });
+    } catch (const std::runtime_error &) {
+    }
+
+    // The insert after the savepoint is undone, the one before it is kept
+    sql.transaction([&]() {
+      sql.query("INSERT INTO kv VALUES ('b', 3);");
+      sql.query("SAVEPOINT undo;");
+      sql.query("INSERT INTO kv VALUES ('c', 4);");
+      sql.query("ROLLBACK TO undo;");
+      sql.query("RELEASE undo;");
+    });
+
+    // A reader keeps every COMMIT busy, no attempt may publish
+    SQL_DB reader("test.db");
+    BusyPolicy_t policy;
+    policy.timeoutMs = 50;
+    policy.lockTimeoutMs = 10;
+    sql.setBusyPolicy(policy);
+    reader.query("BEGIN;");
+    reader.query("SELECT * FROM kv;");
+    try {
+      sql.transaction([&]() { sql.query("INSERT INTO kv VALUES ('d', 5);"); });
+      throw std::runtime_error("Commit went through a shared lock");
+    } catch (const SQL_Error_t &e) {
+      if (!e.busy())
+        throw;
+    }
+    reader.query("COMMIT;");
+
+    ChangeEvent_t insert, update, kept, extra;
+    if (!stream->tryPop(insert) || !stream->tryPop(update) ||
+        !stream->tryPop(kept) || stream->tryPop(extra))
+      throw std::runtime_error("Expected exactly the committed changes");
+    if (insert.op != ChangeEvent_t::Insert ||
+        update.op != ChangeEvent_t::Update || update.rowid != insert.rowid ||
+        kept.op != ChangeEvent_t::Insert || kept.rowid != insert.rowid + 1)
+      throw std::runtime_error("Unexpected change events");
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+    if (update.before.getValues()[1].as_int() != 1 ||
+        update.after.getValues()[1].as_int() != 2 ||
+        kept.after.getValues()[1].as_int() != 3)
+      throw std::runtime_error("Unexpected row images");
+#endif
+
+    sql.stopCapture();
+    sql.dropTable("kv");
+  };
+  tryFunction(change_capture, "Change capture");
+
+  auto matrix_snapshot = []() {
+    SQL_DB sql("test.db");
+    Matrix_t cache = sql.query("SELECT 1 AS id, 'one' AS label, 0.5 AS score "
+                               "UNION ALL SELECT 2, NULL, 1.5;");
+    MatrixSnapshot_t::save(cache, "test.snapshot");
+
+    MatrixSnapshot_t snapshot("test.snapshot");
+    if (snapshot.rowCount != 2 || strcmp(snapshot.getColumnName(1), "label") ||
+        strcmp(snapshot.as_text(0, 1), "one") ||
+        snapshot.type(1, 1) != SqlValue::Null || snapshot.as_real(1, 2) != 1.5)
+      throw std::runtime_error("Snapshot does not match the matrix");
+
+    Matrix_t loaded = snapshot.toMatrix();
+    for (size_t i = 0; i < cache.rowCount * cache.colCount; ++i)
+      if (loaded.getValues()[i] != cache.getValues()[i])
+        throw std::runtime_error("Snapshot round trip changed a value");
+    snapshot = MatrixSnapshot_t();
+
+    // A row offset past the column data, then an unknown type byte
+    auto corrupt = [](size_t field, size_t at, const void *bytes, size_t n) {
+      FILE *f = fopen("test.snapshot", "r+b");
+      SnapshotColumn_t label;
+      fseek(f,
+            sizeof(SnapshotHeader_t) + 3 * MAX_COLUMN_NAME_LENGTH +
+                sizeof(SnapshotColumn_t),
+            SEEK_SET);
+      if (fread(&label, sizeof(label), 1, f) != 1)
+        throw std::runtime_error("Snapshot directory is missing");
+      uint64_t sections[] = {label.fixed, label.offsets, label.types};
+      fseek(f, sections[field] + at, SEEK_SET);
+      fwrite(bytes, 1, n, f);
+      fclose(f);
+    };
+    uint64_t farOffset = 1000;
+    uint8_t badType = 9;
+    corrupt(1, 8, &farOffset, 8);
+    try {
+      snapshot.open("test.snapshot");
+      throw std::runtime_error("Opened a corrupt snapshot");
+    } catch (const std::runtime_error &e) {
+      if (strstr(e.what(), "Snapshot Error: invalid") == nullptr)
+        throw;
+    }
+    MatrixSnapshot_t::save(cache, "test.snapshot");
+    corrupt(2, 1, &badType, 1);
+    try {
+      snapshot.open("test.snapshot");
+      throw std::runtime_error("Opened a snapshot with a bad type");
+    } catch (const std::runtime_error &e) {
+      if (strstr(e.what(), "Snapshot Error: invalid") == nullptr)
+        throw;
+    }
+    std::remove("test.snapshot");
+  };
+  tryFunction(matrix_snapshot, "Matrix snapshot");
+
+  auto copy_on_write = []() {
+    Matrix_t original = Matrix_t(1, 4);
+    original.setColumnName("v", 0);
+    Row_t r = Row_t(1);
+    r.insertValue(1L, 0);
+    original.appendRow(r);
+
+    Matrix_t copy = original;
+    Row_t rowCopy = r;
+    if (copy.getValues() != original.getValues() ||
+        rowCopy.getValues() != r.getValues())
+      throw std::runtime_error("Copies did not share their values");
+
+    copy.appendRow(r);
+    copy.setColumnName("w", 0);
+    rowCopy.insertValue(2L, 0);
+    if (original.rowCount != 1 || strcmp(original.getColumnName(0), "v") ||
+        copy.rowCount != 2 || r.getValues()[0].as_int() != 1 ||
+        rowCopy.getValues()[0].as_int() != 2)
+      throw std::runtime_error("Changing a copy changed the original");
+
+    // Writing through the values detaches too
+    Matrix_t edited = original;
+    Row_t editedRow = r;
+    edited.editValues()[0] = SqlValue(3L);
+    editedRow.editValues()[0] = SqlValue(3L);
+    if (original.getValues()[0].as_int() != 1 ||
+        r.getValues()[0].as_int() != 1 ||
+        edited.getValues()[0].as_int() != 3 ||
+        editedRow.getValues()[0].as_int() != 3)
+      throw std::runtime_error("Editing a copy changed the original");
+  };
+  tryFunction(copy_on_write, "Copy on write");
+
+  auto dictionary_encoding = []() {
+    SQL_DB sql("test.db");
+    sql.setDictionaryEncoding(1024);
+    const char *statuses = "SELECT 1 AS id, 'ok' AS status UNION ALL "
+                           "SELECT 2, 'failed' UNION ALL SELECT 3, 'ok';";
+    Matrix_t runs = sql.query(statuses);
+    Matrix_t again = sql.query(statuses);
+    Row_t first = runs.getRow(0);
+    if (runs.getColumnDictionary(1) == nullptr ||
+        runs.getColumnDictionary(1)->size() != 2 ||
+        runs.getValues()[1].as_text() != runs.getValues()[5].as_text())
+      throw std::runtime_error("Status column was not interned");
+
+    Matrix_t grouped = hashGroupBy(runs, {1}, {{0, Aggregate_t::Count}});
+    Matrix_t joined = hashJoin(runs, {1}, again, {1});
+    runs = Matrix_t();
+    if (grouped.rowCount != 2 || grouped.getValues()[1].as_int() != 2 ||
+        joined.rowCount != 5 || strcmp(first.getValues()[1].as_text(), "ok"))
+      throw std::runtime_error("Unexpected result on interned column");
+  };
+  tryFunction(dictionary_encoding, "Dictionary encoded text");
+
+  auto time_series = []() {
+    SQL_DB sql("test.db");
+    Matrix_t readings = Matrix_t("readings", 3);
+    readings.setColumnName("time", 0);
+    readings.setColumnName("sensor", 1);
+    readings.setColumnName("value", 2);
+    TimeSeriesPolicy_t policy;
+    policy.interval = 100;
+    policy.retention = 200;
+    sql.createTimeSeries(readings, "time", policy);
+
+    Row_t r = Row_t(3);
+    for (long t = 0; t < 500; t += 25) {
+      r.insertValue(t, 0);
+      r.insertValue(t % 2, 1);
+      r.insertValue(0.5 * t, 2);
+      sql.insertInto(readings, r);
+    }
+
+    // Partitions 0 and 100 expired once 400 opened
+    Matrix_t all = sql.query("SELECT count(*) FROM readings;");
+    Matrix_t range = sql.queryTimeSeries(
+        "readings", 250, 350, "SELECT count(*), min(time) FROM readings;");
+    if (sql.tableExists("readings_p100") || !sql.tableExists("readings_p400") ||
+        all.getValues()[0].as_int() != 12 ||
+        range.getValues()[0].as_int() != 4 ||
+        range.getValues()[1].as_int() != 250)
+      throw std::runtime_error("Unexpected partitions or range result");
+
+    // A batch that opens partitions 500 and 600, expiring 200 and 300, then
+    // fails on its last row is rolled back entirely
+    Row_t batch[3] = {Row_t(3), Row_t(3), Row_t(3)};
+    for (long i = 0; i < 3; ++i) {
+      batch[i].insertValue(i < 2 ? SqlValue(500 + 100 * i) : SqlValue("x"), 0);
+      batch[i].insertValue(0L, 1);
+      batch[i].insertValue(0.0, 2);
+    }
+    try {
+      sql.insertManySameTypeInto(readings, batch, 3);
+      throw std::runtime_error("Inserted a Text time");
+    } catch (const std::runtime_error &e) {
+      if (strstr(e.what(), "TimeSeries Error") == nullptr)
+        throw;
+    }
+    r.insertValue(450L, 0);
+    sql.insertInto(readings, r);
+    all = sql.query("SELECT count(*) FROM readings;");
+    if (!sql.tableExists("readings_p200") || sql.tableExists("readings_p500") ||
+        all.getValues()[0].as_int() != 13)
+      throw std::runtime_error("Rolled back batch left partitions behind");
+    // Opening 500 again expires 200 for real
+    r.insertValue(500L, 0);
+    sql.insertInto(readings, r);
+    all = sql.query("SELECT count(*) FROM readings;");
+    if (sql.tableExists("readings_p200") || all.getValues()[0].as_int() != 10)
+      throw std::runtime_error("Partition was not created again");
+    sql.dropTimeSeries("readings");
+  };
+  tryFunction(time_series, "Time series partitions");
+
+  // Last, SQLite is shut down to take the pool as its allocator
+  auto memory_pool = []() {
+    MemoryPool_t &pool = memoryPool();
+    sqlite3_shutdown();
+    pool.installInSQLite(4096, 64);
+    size_t before = pool.stats().blocksInUse;
+    {
+      SQL_DB sql("test.db");
+      Matrix_t words = sql.query(
+          "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+          "WHERE i < 1000) SELECT 'pooled' || i FROM n;");
+      Matrix_t copy = words;
+      copy.editValues()[0] = SqlValue("changed");
+      if (words.rowCount != 1000 || pool.stats().blocksInUse <= before)
+        throw std::runtime_error("Query did not allocate from the pool");
+    }
+    if (pool.stats().blocksInUse != before)
+      throw std::runtime_error("Pool blocks leaked");
+
+    pool.setLimit(pool.stats().bytesInUse + 4096);
+    bool refused = false;
+    try {
+      Matrix_t big = Matrix_t((size_t)4, (size_t)4096);
+    } catch (const std::bad_alloc &) {
+      refused = true;
+    }
+    pool.setLimit(0);
+    if (!refused || pool.stats().failures == 0)
+      throw std::runtime_error("Limit did not refuse the allocation");
+
+    // SQLite allocates from the pool too and gets SQLITE_NOMEM
+    {
+      SQL_DB sql("test.db");
+      pool.setLimit(pool.stats().bytesInUse + 65536);
+      int code = SQLITE_OK;
+      try {
+        sql.query("SELECT randomblob(1000000);");
+      } catch (const SQL_Error_t &e) {
+        code = e.code;
+      }
+      pool.setLimit(0);
+      if (code != SQLITE_NOMEM)
+        throw std::runtime_error("Limit did not fail the statement");
+    }
+
+    // Threads publish their counters when they end, blocks they kept are
+    // released by this one
+    MemoryStats_t start = pool.stats();
+    std::vector<void *> kept(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kept.size(); ++t)
+      threads.emplace_back([&pool, &kept, t]() {
+        for (size_t i = 0; i < 100; ++i)
+          pool.release(pool.allocate(24 + i));
+        kept[t] = pool.allocate(100);
+      });
+    for (std::thread &t : threads)
+      t.join();
+    MemoryStats_t joined = pool.stats();
+    for (void *p : kept)
+      pool.release(p);
+    if (joined.allocations != start.allocations + 404 ||
+        joined.blocksInUse != start.blocksInUse + 4 ||
+        pool.stats().blocksInUse != start.blocksInUse ||
+        pool.stats().bytesInUse != start.bytesInUse)
+      throw std::runtime_error("Counters of ended threads were lost");
+  };
+  tryFunction(memory_pool, "Memory pool");
+
+  return failures == 0 ? 0 : 1;
 }